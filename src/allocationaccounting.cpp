@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "allocationaccounting.h"
+
+#include "../build/src/debug.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+static const char* const SUBSYSTEM_NAMES[AllocationAccounting::SubsystemCount] {
+    "decoding", "itemLists", "caches", "writeQueue"
+};
+
+AllocationAccounting* AllocationAccounting::self()
+{
+    static AllocationAccounting instance;
+    return &instance;
+}
+
+void AllocationAccounting::allocated(Subsystem subsystem, qint64 bytes)
+{
+    Counters &counters = this->counters[subsystem];
+    ++counters.allocations;
+    counters.bytes += bytes;
+    const qint64 live = counters.live += bytes;
+    qint64 peak = counters.peak;
+    while (live > peak && !counters.peak.compare_exchange_weak(peak, live)) {}
+}
+
+void AllocationAccounting::released(Subsystem subsystem, qint64 bytes)
+{
+    this->counters[subsystem].live -= bytes;
+}
+
+QVariantMap AllocationAccounting::snapshot() const
+{
+    QVariantMap result;
+    for (int i = 0; i < SubsystemCount; ++i) {
+        const Counters &counters = this->counters[i];
+        result.insert(QString::fromLatin1(SUBSYSTEM_NAMES[i]), QVariantMap {
+            { QStringLiteral("allocations"), qint64(counters.allocations) },
+            { QStringLiteral("bytes"), qint64(counters.bytes) },
+            { QStringLiteral("liveBytes"), qint64(counters.live) },
+            { QStringLiteral("peakBytes"), qint64(counters.peak) },
+        });
+    }
+    return result;
+}
+
+QString AllocationAccounting::mallocInfo() const
+{
+#ifdef __GLIBC__
+    char* buffer = nullptr;
+    size_t size = 0;
+    FILE* stream = open_memstream(&buffer, &size);
+    if (!stream) {
+        return QString();
+    }
+    malloc_info(0, stream);
+    fclose(stream);
+    const QString info = QString::fromUtf8(buffer, int(size));
+    free(buffer);
+    qCInfo(log_decsyncresource, "malloc_info: %s", qUtf8Printable(info));
+    return info;
+#else
+    return QString();
+#endif
+}
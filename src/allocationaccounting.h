@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef ALLOCATIONACCOUNTING_H
+#define ALLOCATIONACCOUNTING_H
+
+#include <QObject>
+#include <QVariantMap>
+
+#include <atomic>
+
+/**
+ * Counts the allocations made by the resource's subsystems, and the bytes
+ * they hold, and exports them on D-Bus under /Allocations, so memory growth
+ * can be looked into on users' machines without attaching a heap profiler.
+ *
+ * Only built with the WITH_ALLOCATION_ACCOUNTING CMake option. Otherwise,
+ * the ACCOUNT_* macros below compile to nothing. All methods may be called
+ * from any thread.
+ */
+class AllocationAccounting : public QObject
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "org.kde.Akonadi.DecSync.Allocations")
+
+public:
+    enum Subsystem {
+        // Entries read by replays, until their items were handed over.
+        Decoding,
+        // Items being built for Akonadi.
+        ItemLists,
+        // Payloads kept by the PayloadStore.
+        Caches,
+        // Entries waiting to be written to DecSync.
+        WriteQueue,
+        SubsystemCount
+    };
+
+    static AllocationAccounting* self();
+
+    void allocated(Subsystem subsystem, qint64 bytes);
+    void released(Subsystem subsystem, qint64 bytes);
+
+public Q_SLOTS:
+    /**
+     * Returns, for each subsystem, the number of allocations and bytes
+     * allocated so far, and the bytes currently and at most held.
+     */
+    Q_SCRIPTABLE QVariantMap snapshot() const;
+
+    /**
+     * Returns the allocator's statistics, as written by malloc_info(), and
+     * logs them.
+     */
+    Q_SCRIPTABLE QString mallocInfo() const;
+
+private:
+    struct Counters {
+        std::atomic<qint64> allocations { 0 };
+        std::atomic<qint64> bytes { 0 };
+        std::atomic<qint64> live { 0 };
+        std::atomic<qint64> peak { 0 };
+    };
+    Counters counters[SubsystemCount];
+};
+
+#ifdef DECSYNC_ALLOCATION_ACCOUNTING
+#define ACCOUNT_ALLOCATION(subsystem, bytes) \
+    AllocationAccounting::self()->allocated(AllocationAccounting::subsystem, (bytes))
+#define ACCOUNT_RELEASE(subsystem, bytes) \
+    AllocationAccounting::self()->released(AllocationAccounting::subsystem, (bytes))
+#else
+#define ACCOUNT_ALLOCATION(subsystem, bytes) Q_UNUSED(bytes)
+#define ACCOUNT_RELEASE(subsystem, bytes) Q_UNUSED(bytes)
+#endif
+
+#endif
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "canonicalize.h"
+
+#include <QList>
+#include <QVector>
+
+#include <algorithm>
+#include <climits>
+
+/**
+ * Splits at the given separator, except where it's inside double quotes, as
+ * in parameter values like LABEL="a;b".
+ */
+static QList<QByteArray> splitUnquoted(const QByteArray &line, char separator, int maxParts)
+{
+    QList<QByteArray> parts;
+    bool quoted = false;
+    int start = 0;
+    for (int i = 0; i < line.size(); ++i) {
+        if (line[i] == '"') {
+            quoted = !quoted;
+        } else if (line[i] == separator && !quoted && parts.size() < maxParts - 1) {
+            parts << line.mid(start, i - start);
+            start = i + 1;
+        }
+    }
+    parts << line.mid(start);
+    return parts;
+}
+
+/**
+ * Canonicalizes one unfolded content line: NAME;PARAM=value;...:value
+ */
+static QByteArray canonicalLine(const QByteArray &line)
+{
+    const QList<QByteArray> nameAndValue = splitUnquoted(line, ':', 2);
+    if (nameAndValue.size() < 2) {
+        return line;
+    }
+
+    QList<QByteArray> params = splitUnquoted(nameAndValue[0], ';', INT_MAX);
+    QByteArray result = params.takeFirst().toUpper();
+    for (QByteArray &param : params) {
+        const int equals = param.indexOf('=');
+        param = equals < 0 ? param.toUpper() : param.left(equals).toUpper() + param.mid(equals);
+    }
+    std::sort(params.begin(), params.end());
+    for (const QByteArray &param : params) {
+        result += ';' + param;
+    }
+    return result + ':' + nameAndValue[1];
+}
+
+namespace {
+    struct Component {
+        QByteArray begin;
+        QVector<QByteArray> lines;
+    };
+}
+
+QByteArray canonicalPayload(const QByteArray &payload)
+{
+    QByteArray text = payload;
+    text.replace("\r\n", "\n").replace('\r', '\n');
+    // Folded lines continue with a single space or tab.
+    text.replace("\n ", "").replace("\n\t", "");
+
+    // Each component collects its properties and its already canonicalized
+    // subcomponents, which are sorted together once it ends.
+    QVector<Component> stack { Component() };
+    for (const QByteArray &rawLine : text.split('\n')) {
+        QByteArray line = rawLine;
+        while (!line.isEmpty() && (line.endsWith(' ') || line.endsWith('\t'))) {
+            line.chop(1);
+        }
+        if (line.isEmpty()) {
+            continue;
+        }
+        line = canonicalLine(line);
+
+        if (line.startsWith("BEGIN:")) {
+            stack.append({ line, {} });
+        } else if (line.startsWith("END:") && stack.size() > 1) {
+            Component component = stack.takeLast();
+            std::sort(component.lines.begin(), component.lines.end());
+            QByteArray serialized = component.begin;
+            for (const QByteArray &child : component.lines) {
+                serialized += '\n' + child;
+            }
+            serialized += '\n' + line;
+            stack.last().lines << serialized;
+        } else {
+            stack.last().lines << line;
+        }
+    }
+
+    // Unterminated components are kept in their order of appearance.
+    QByteArray result;
+    for (const Component &component : stack) {
+        if (!component.begin.isEmpty()) {
+            result += component.begin + '\n';
+        }
+        for (const QByteArray &line : component.lines) {
+            result += line + '\n';
+        }
+    }
+    return result;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CANONICALIZE_H
+#define CANONICALIZE_H
+
+#include <QByteArray>
+
+/**
+ * Brings a vCard or iCalendar payload into a canonical form, so that
+ * payloads that only differ in how a client serialized them hash the same:
+ *
+ * - line endings are normalized and folded lines unfolded,
+ * - trailing whitespace and empty lines are dropped,
+ * - property and parameter names are upper-cased and parameters sorted,
+ * - the properties and subcomponents of each component are sorted.
+ *
+ * The result is only meant for hashing; it's not necessarily valid vCard or
+ * iCalendar anymore and must not be handed to Akonadi.
+ */
+QByteArray canonicalPayload(const QByteArray &payload);
+
+#endif
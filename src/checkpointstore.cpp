@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "checkpointstore.h"
+#include "durablefile.h"
+#include "threadpriority.h"
+
+#include "../build/src/debug.h"
+
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+#include <QtConcurrent>
+
+#define CHECKPOINT_MAGIC   QByteArrayLiteral("DSCP")
+#define CHECKPOINT_SUFFIX  ".checkpoint"
+
+static QDataStream &operator<<(QDataStream &stream, const Checkpoint &checkpoint)
+{
+    return stream << checkpoint.signature << checkpoint.itemHashes << checkpoint.name;
+}
+
+static QDataStream &operator>>(QDataStream &stream, Checkpoint &checkpoint)
+{
+    return stream >> checkpoint.signature >> checkpoint.itemHashes >> checkpoint.name;
+}
+
+CheckpointStore::CheckpointStore(const QString &directory)
+    : directory{directory}
+{
+    QDir().mkpath(directory);
+    // One thread keeps the writes of a collection in order.
+    this->writer.setMaxThreadCount(1);
+}
+
+CheckpointStore::~CheckpointStore()
+{
+    // Don't lose checkpoints that were put just before quitting.
+    this->writer.waitForDone();
+}
+
+QString CheckpointStore::pathFor(const QString &collectionRemoteId) const
+{
+    return this->directory + QLatin1Char('/') +
+        durableFileName(collectionRemoteId, CHECKPOINT_SUFFIX);
+}
+
+Checkpoint CheckpointStore::get(const QString &collectionRemoteId) const
+{
+    QMutexLocker locker(&this->mutex);
+    const auto cached = this->cache.constFind(collectionRemoteId);
+    if (cached != this->cache.constEnd()) {
+        return *cached;
+    }
+
+    Checkpoint checkpoint;
+    QByteArray body;
+    if (this->pendingClears > 0) {
+        // The file is about to be deleted; don't bring it back.
+    } else if (readDurableFile(pathFor(collectionRemoteId), CHECKPOINT_MAGIC, CHECKPOINT_VERSION, &body)) {
+        QDataStream stream(body);
+        stream.setVersion(QDataStream::Qt_5_6);
+        stream >> checkpoint;
+        if (stream.status() != QDataStream::Ok) {
+            checkpoint = Checkpoint();
+        }
+    }
+    if (!checkpoint.itemHashes.isEmpty() &&
+        checkpoint.itemHashes.constBegin().key().startsWith(QLatin1String("resources/"))) {
+        // Written while item remote IDs were still whole DecSync paths. Forget
+        // the replay, so the next one delivers all items as if for the first
+        // time; Akonadi then finds its items by GID and gives them their new
+        // remote IDs. The collection's name is still good.
+        checkpoint.signature.clear();
+        checkpoint.itemHashes.clear();
+    }
+    this->cache.insert(collectionRemoteId, checkpoint);
+    return checkpoint;
+}
+
+void CheckpointStore::put(const QString &collectionRemoteId, const Checkpoint &checkpoint)
+{
+    {
+        QMutexLocker locker(&this->mutex);
+        this->cache.insert(collectionRemoteId, checkpoint);
+    }
+
+    // Serialize now, while the checkpoint can't change under our feet.
+    QByteArray body;
+    {
+        QDataStream stream(&body, QIODevice::WriteOnly);
+        stream.setVersion(QDataStream::Qt_5_6);
+        stream << checkpoint;
+    }
+    const QString path = pathFor(collectionRemoteId);
+    QtConcurrent::run(&this->writer, [path, body]() {
+        enterBackgroundPriority();
+        writeDurableFile(path, CHECKPOINT_MAGIC, CHECKPOINT_VERSION, body);
+    });
+}
+
+void CheckpointStore::remove(const QString &collectionRemoteId)
+{
+    {
+        QMutexLocker locker(&this->mutex);
+        this->cache.insert(collectionRemoteId, Checkpoint());
+    }
+    const QString path = pathFor(collectionRemoteId);
+    QtConcurrent::run(&this->writer, [path]() {
+        QFile::remove(path);
+    });
+}
+
+void CheckpointStore::clear()
+{
+    {
+        QMutexLocker locker(&this->mutex);
+        this->cache.clear();
+        // Until the files are gone, get() must not read them again.
+        ++this->pendingClears;
+    }
+    const QString directory = this->directory;
+    QtConcurrent::run(&this->writer, [this, directory]() {
+        QDir dir(directory);
+        const QStringList files =
+            dir.entryList({ QStringLiteral("*" CHECKPOINT_SUFFIX) }, QDir::Files);
+        for (const QString &file : files) {
+            dir.remove(file);
+        }
+        QMutexLocker locker(&this->mutex);
+        --this->pendingClears;
+    });
+}
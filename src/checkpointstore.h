@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHECKPOINTSTORE_H
+#define CHECKPOINTSTORE_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QMutex>
+#include <QString>
+#include <QThreadPool>
+
+// Bump this whenever the serialized form of Checkpoint or the way item hashes
+// are computed changes; checkpoints of other versions are ignored, which only
+// costs one full replay.
+#define CHECKPOINT_VERSION 2
+
+/**
+ * What the resource remembers about a collection between syncs.
+ */
+struct Checkpoint {
+    // treeSignature() of the collection directory when it was last replayed.
+    QByteArray signature;
+    // itemHash() of each item as of that replay, by item remote ID.
+    QHash<QString, QByteArray> itemHashes;
+    // Friendly name from the collection's static info.
+    QString name;
+};
+
+/**
+ * Keeps a Checkpoint per collection in the resource's data directory, so
+ * that incremental syncs can resume right away after a restart or crash.
+ *
+ * Checkpoints are loaded lazily, the first time a collection is asked for,
+ * and cached. Updated checkpoints are written with writeDurableFile() on a
+ * background thread, one file per collection, in the order they were put.
+ */
+class CheckpointStore
+{
+public:
+    explicit CheckpointStore(const QString &directory);
+    ~CheckpointStore();
+
+    /**
+     * Returns the checkpoint of the given collection, or an empty one if
+     * there is none.
+     */
+    Checkpoint get(const QString &collectionRemoteId) const;
+
+    void put(const QString &collectionRemoteId, const Checkpoint &checkpoint);
+    void remove(const QString &collectionRemoteId);
+
+    /**
+     * Forgets all checkpoints, e.g. when the DecSync directory changed.
+     */
+    void clear();
+
+private:
+    QString pathFor(const QString &collectionRemoteId) const;
+
+    const QString directory;
+    mutable QMutex mutex;
+    mutable QHash<QString, Checkpoint> cache;
+    // Number of clear() calls whose files aren't deleted yet.
+    int pendingClears = 0;
+    QThreadPool writer;
+};
+
+#endif
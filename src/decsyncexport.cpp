@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * akonadi_decsync_export: dumps the current state of DecSync collections to
+ * .vcf/.ics files or binary snapshots, e.g. for backups.
+ */
+
+#include "replay.h"
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDataStream>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QSaveFile>
+#include <QTextStream>
+#include <QThread>
+#include <QtConcurrent>
+
+#include <libdecsync.h>
+
+#define APPID_LENGTH      256
+#define MAX_COLLECTIONS   256
+#define SNAPSHOT_MAGIC    QByteArrayLiteral("DSSN")
+// Version 2 identifies items by UID rather than by DecSync path.
+#define SNAPSHOT_VERSION  2
+
+const QList<const char*> COLLECTION_TYPES { "calendars", "contacts" };
+
+/**
+ * What exporting one collection amounted to.
+ */
+struct ExportResult {
+    QString collection;
+    qint64 items;
+    qint64 bytes;
+    QString error;
+};
+
+/**
+ * Lists the remote IDs of all DecSync collections, e.g. contacts/<name>.
+ */
+static QStringList listCollections(const QString &decsyncDir)
+{
+    QStringList collections;
+    for (const char* type : COLLECTION_TYPES) {
+        QByteArray backingStore[MAX_COLLECTIONS];
+        const char* names[MAX_COLLECTIONS];
+        for (int i = 0; i < MAX_COLLECTIONS; ++i) {
+            // decsync_list_decsync_collections needs each element to be 256
+            // chars long.
+            backingStore[i] = QByteArray(256, '\0');
+            names[i] = backingStore[i].constData();
+        }
+        const int found = decsync_list_decsync_collections(qUtf8Printable(decsyncDir), type,
+                                                           names, MAX_COLLECTIONS);
+        for (int i = 0; i < found; ++i) {
+            collections << QString::fromUtf8(type) + QPATHSEP + QString::fromUtf8(names[i]);
+        }
+    }
+    return collections;
+}
+
+/**
+ * Gets the app ID that stored the most recent entry of a collection. Its
+ * stored entries are the most up-to-date view of the collection there is,
+ * and they can be read as they are, without initializing stored entries for
+ * an app ID of our own, which would write to the DecSync directory and sync
+ * to every other device. Returns an empty app ID if the collection can't be
+ * opened.
+ */
+static QByteArray latestAppId(const QString &decsyncDir, const QByteArray &type,
+                              const QByteArray &name)
+{
+    Decsync sync;
+    // Only used to open the collection; nothing is written under it.
+    if (decsync_new(&sync, qUtf8Printable(decsyncDir), type.constData(), name.constData(),
+                    "akonadi-export") != 0) {
+        return QByteArray();
+    }
+    char appId[APPID_LENGTH] = {};
+    decsync_latest_app_id(sync, appId, APPID_LENGTH);
+    decsync_free(sync);
+    return QByteArray(appId);
+}
+
+/**
+ * Writes every item of a collection to a file below outputDir as soon as it's
+ * decoded, so only one item is in memory at a time. Items are concatenated
+ * into a .vcf or .ics file (several VCALENDAR objects in one file are valid
+ * iCalendar), or written as (remote ID, payload) pairs to a snapshot.
+ */
+static ExportResult exportCollection(const QString &decsyncDir, const QString &collection,
+                                     const QString &outputDir, bool snapshot)
+{
+    ExportResult result { collection, 0, 0, QString() };
+    const QString type = collection.section(QPATHSEP, 0, 0);
+    const QByteArray name = collection.section(QPATHSEP, 1).toUtf8();
+    const QByteArray appId = latestAppId(decsyncDir, type.toUtf8(), name);
+    if (appId.isEmpty()) {
+        result.error = QStringLiteral("cannot open collection");
+        return result;
+    }
+    const QString suffix = snapshot ? QStringLiteral(".snapshot") :
+        type == QLatin1String("calendars") ? QStringLiteral(".ics") : QStringLiteral(".vcf");
+    const QString path = outputDir + QLatin1Char('/') + collection + suffix;
+    QDir().mkpath(outputDir + QLatin1Char('/') + type);
+
+    // The file only replaces an older export once it's complete.
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly)) {
+        result.error = file.errorString();
+        return result;
+    }
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_5_6);
+    if (snapshot) {
+        file.write(SNAPSHOT_MAGIC);
+        stream << quint32(SNAPSHOT_VERSION);
+    }
+
+    const int error = readEntries(decsyncDir, type.toUtf8(), name, appId,
+                                  [&](const QString &remoteId, const QByteArray &payload) {
+        if (snapshot) {
+            stream << remoteId << payload;
+        } else {
+            file.write(payload);
+            if (!payload.endsWith('\n')) {
+                file.write("\r\n");
+            }
+        }
+        ++result.items;
+        result.bytes += payload.size();
+    });
+    if (error) {
+        file.cancelWriting();
+        result.error = QStringLiteral("libdecsync error %1").arg(error);
+    } else if (!file.commit()) {
+        result.error = file.errorString();
+    }
+    return result;
+}
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName(QStringLiteral("akonadi_decsync_export"));
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral(
+        "Exports DecSync collections to .vcf/.ics files or binary snapshots."));
+    parser.addHelpOption();
+    const QCommandLineOption directoryOption(
+        { QStringLiteral("d"), QStringLiteral("directory") },
+        QStringLiteral("DecSync directory to export from."), QStringLiteral("directory"));
+    const QCommandLineOption outputOption(
+        { QStringLiteral("o"), QStringLiteral("output") },
+        QStringLiteral("Directory to write the exported files to."), QStringLiteral("directory"),
+        QStringLiteral("."));
+    const QCommandLineOption snapshotOption(
+        { QStringLiteral("s"), QStringLiteral("snapshot") },
+        QStringLiteral("Write binary snapshots instead of .vcf/.ics files."));
+    const QCommandLineOption jobsOption(
+        { QStringLiteral("j"), QStringLiteral("jobs") },
+        QStringLiteral("Number of collections exported at once."), QStringLiteral("jobs"),
+        QString::number(QThread::idealThreadCount()));
+    parser.addOptions({ directoryOption, outputOption, snapshotOption, jobsOption });
+    parser.addPositionalArgument(QStringLiteral("collections"),
+                                 QStringLiteral("Collections to export, e.g. contacts/<name>; all by default."),
+                                 QStringLiteral("[collections...]"));
+    parser.process(app);
+
+    QTextStream out(stdout);
+    QTextStream err(stderr);
+    const QString decsyncDir = parser.value(directoryOption);
+    const int jobs = parser.value(jobsOption).toInt();
+    if (decsyncDir.isEmpty() || jobs <= 0) {
+        parser.showHelp(1);
+    }
+    QStringList collections = parser.positionalArguments();
+    if (collections.isEmpty()) {
+        collections = listCollections(decsyncDir);
+    }
+
+    const QString outputDir = parser.value(outputOption);
+    const bool snapshot = parser.isSet(snapshotOption);
+
+    QElapsedTimer timer;
+    timer.start();
+    QThreadPool pool;
+    pool.setMaxThreadCount(jobs);
+    QVector<QFuture<ExportResult>> exports;
+    for (const QString &collection : collections) {
+        exports << QtConcurrent::run(&pool, exportCollection, decsyncDir, collection,
+                                     outputDir, snapshot);
+    }
+
+    qint64 items = 0;
+    qint64 bytes = 0;
+    int failures = 0;
+    for (const QFuture<ExportResult> &future : exports) {
+        const ExportResult result = future.result();
+        if (!result.error.isEmpty()) {
+            err << "cannot export " << result.collection << ": " << result.error << "\n";
+            ++failures;
+            continue;
+        }
+        out << result.collection << ": " << result.items << " items\n";
+        items += result.items;
+        bytes += result.bytes;
+    }
+
+    const double seconds = qMax(timer.nsecsElapsed(), Q_INT64_C(1)) / 1e9;
+    out << "exported " << items << " items (" << bytes / 1024 << " KiB) from "
+        << collections.size() - failures << " collections in " << seconds << " s: "
+        << qRound64(items / seconds) << " items/s, "
+        << bytes / seconds / (1024 * 1024) << " MiB/s\n";
+    return failures ? 1 : 0;
+}
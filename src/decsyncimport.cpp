@@ -0,0 +1,333 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * akonadi_decsync_import: writes the contacts of .vcf files or the events of
+ * .ics files straight into a DecSync collection, in large batches, instead of
+ * creating every item through Akonadi.
+ */
+
+#include "decsyncwriter.h"
+#include "replay.h"
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
+#include <QSet>
+#include <QTextStream>
+#include <QUuid>
+#include <QtConcurrent>
+
+#include <libdecsync.h>
+
+#define APPID_LENGTH       256
+#define DEFAULT_BATCH_SIZE 1000
+#define CRLF               "\r\n"
+
+/**
+ * An item read from an input file.
+ */
+struct SplitItem {
+    QByteArray uid;
+    // The whole item as stored in DecSync: a vCard, or a VCALENDAR with a
+    // single component.
+    QByteArray payload;
+    // For calendars, the component alone, e.g. the VEVENT.
+    QByteArray component;
+};
+
+/**
+ * Splits a file of several vCards, or an iCalendar file of several events,
+ * into one payload per item. Only one item is kept in memory at a time, so
+ * arbitrarily large files can be imported.
+ *
+ * Each calendar component is wrapped in a VCALENDAR of its own, along with
+ * the calendar's properties and all time zones seen so far; like other
+ * iCalendar writers, we assume time zones come before the events using them.
+ */
+class PayloadSplitter
+{
+public:
+    PayloadSplitter(QIODevice* device, bool calendar)
+        : device{device}, calendar{calendar} {}
+
+    /**
+     * Reads the next item. Returns false at the end of the input.
+     */
+    bool next(SplitItem* item);
+
+private:
+    static bool isLine(const QByteArray &line, const char* expected);
+    static QByteArray findUid(const QByteArrayList &lines);
+
+    QIODevice* device;
+    bool calendar;
+    QByteArray calendarProperties;
+    QByteArray timezones;
+};
+
+bool PayloadSplitter::isLine(const QByteArray &line, const char* expected)
+{
+    return qstricmp(line.constData(), expected) == 0;
+}
+
+/**
+ * Gets the value of the first UID property, unfolding it if needed.
+ */
+QByteArray PayloadSplitter::findUid(const QByteArrayList &lines)
+{
+    for (int i = 0; i < lines.size(); ++i) {
+        const QByteArray name = lines[i].left(4).toUpper();
+        if (name != "UID:" && name != "UID;") {
+            continue;
+        }
+        QByteArray uid = lines[i].mid(lines[i].indexOf(':') + 1);
+        while (++i < lines.size() && (lines[i].startsWith(' ') || lines[i].startsWith('\t'))) {
+            uid += lines[i].mid(1);
+        }
+        return uid.trimmed();
+    }
+    return QByteArray();
+}
+
+bool PayloadSplitter::next(SplitItem* item)
+{
+    QByteArrayList lines;
+    int depth = 0;
+
+    while (!this->device->atEnd()) {
+        QByteArray line = this->device->readLine();
+        while (line.endsWith('\n') || line.endsWith('\r')) {
+            line.chop(1);
+        }
+        if (line.isEmpty()) {
+            continue;
+        }
+
+        if (lines.isEmpty()) {
+            // Between items.
+            if (this->calendar && isLine(line, "BEGIN:VCALENDAR")) {
+                this->calendarProperties.clear();
+                this->timezones.clear();
+            } else if (this->calendar && isLine(line, "END:VCALENDAR")) {
+                // Nothing to do.
+            } else if (line.toUpper().startsWith("BEGIN:") &&
+                       (this->calendar || isLine(line, "BEGIN:VCARD"))) {
+                lines << line;
+                depth = 1;
+            } else if (this->calendar) {
+                this->calendarProperties += line + CRLF;
+            }
+            continue;
+        }
+
+        lines << line;
+        if (line.toUpper().startsWith("BEGIN:")) {
+            ++depth;
+        } else if (line.toUpper().startsWith("END:")) {
+            --depth;
+        }
+        if (depth > 0) {
+            continue;
+        }
+
+        const bool timezone = isLine(lines.first(), "BEGIN:VTIMEZONE");
+        QByteArray uid = findUid(lines);
+        if (uid.isEmpty() && !timezone) {
+            // DecSync needs a UID to store the item under.
+            uid = QUuid::createUuid().toString(QUuid::WithoutBraces).toUtf8();
+            lines.insert(lines.size() - 1, "UID:" + uid);
+        }
+        const QByteArray component = lines.join(CRLF) + CRLF;
+        lines.clear();
+
+        if (!this->calendar) {
+            *item = { uid, component, QByteArray() };
+            return true;
+        }
+        if (timezone) {
+            this->timezones += component;
+            continue;
+        }
+        *item = { uid,
+                  "BEGIN:VCALENDAR" CRLF + this->calendarProperties + this->timezones +
+                      component + "END:VCALENDAR" CRLF,
+                  component };
+        return true;
+    }
+    return false;
+}
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    QCoreApplication::setApplicationName(QStringLiteral("akonadi_decsync_import"));
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription(QStringLiteral(
+        "Imports contacts from .vcf files or events from .ics files into a DecSync collection."));
+    parser.addHelpOption();
+    const QCommandLineOption directoryOption(
+        { QStringLiteral("d"), QStringLiteral("directory") },
+        QStringLiteral("DecSync directory to import into."), QStringLiteral("directory"));
+    const QCommandLineOption nameOption(
+        { QStringLiteral("n"), QStringLiteral("name") },
+        QStringLiteral("Set the collection's name, e.g. when creating it."), QStringLiteral("name"));
+    const QCommandLineOption batchOption(
+        { QStringLiteral("b"), QStringLiteral("batch-size") },
+        QStringLiteral("Number of items written at once."), QStringLiteral("items"),
+        QString::number(DEFAULT_BATCH_SIZE));
+    parser.addOptions({ directoryOption, nameOption, batchOption });
+    parser.addPositionalArgument(QStringLiteral("collection"),
+                                 QStringLiteral("Collection to import into, e.g. contacts/<name>."));
+    parser.addPositionalArgument(QStringLiteral("files"), QStringLiteral("Files to import."),
+                                 QStringLiteral("files..."));
+    parser.process(app);
+
+    QTextStream out(stdout);
+    QTextStream err(stderr);
+    const QStringList arguments = parser.positionalArguments();
+    const QString decsyncDir = parser.value(directoryOption);
+    const int batchSize = parser.value(batchOption).toInt();
+    if (arguments.size() < 2 || decsyncDir.isEmpty() || batchSize <= 0) {
+        parser.showHelp(1);
+    }
+
+    const QString collection = arguments.first();
+    const QString type = collection.section(QPATHSEP, 0, 0);
+    if ((type != QLatin1String("contacts") && type != QLatin1String("calendars")) ||
+        collection.section(QPATHSEP, 1).isEmpty()) {
+        err << "unknown collection " << collection << ", expected contacts/<name> or calendars/<name>\n";
+        return 1;
+    }
+    const bool calendar = type == QLatin1String("calendars");
+
+    char appIdBuffer[APPID_LENGTH];
+    // Writing under the resource's own app ID could clash with its writes.
+    decsync_get_app_id("akonadi-import", appIdBuffer, APPID_LENGTH);
+    const QByteArray appId(appIdBuffer);
+
+    // The next batch is read while the previous one is written.
+    QHash<QByteArray, SplitItem> pending;
+    QByteArrayList order;
+    // UIDs of the calendar items already written, in case a recurrence
+    // exception of theirs only comes up in a later batch.
+    QSet<QByteArray> written;
+    DecSyncBatch extra;
+    if (parser.isSet(nameOption)) {
+        extra[{ QByteArrayLiteral("info") }].insert(encodeJsonValue(QStringLiteral("name")),
+                                                   encodeJsonValue(parser.value(nameOption)));
+    }
+    QFuture<int> writing;
+    bool writeStarted = false;
+    int failures = 0;
+    auto finishWrite = [&]() {
+        if (writeStarted) {
+            failures += writing.result() != 0;
+            writeStarted = false;
+        }
+    };
+    auto writeBatch = [&]() {
+        DecSyncBatch batch = extra;
+        extra.clear();
+        const QByteArray nullKey = encodeJsonValue(QJsonValue());
+        for (const QByteArray &uid : order) {
+            const QByteArray payload = pending.value(uid).payload;
+            batch[{ QByteArrayLiteral("resources"), uid }].insert(
+                nullKey, encodeJsonValue(QString::fromUtf8(payload)));
+            if (calendar) {
+                written.insert(uid);
+            }
+        }
+        pending.clear();
+        order.clear();
+        finishWrite();
+        writing = QtConcurrent::run(writeDecSyncBatch, decsyncDir, collection, appId, batch);
+        writeStarted = true;
+    };
+
+    QElapsedTimer timer;
+    timer.start();
+    qint64 items = 0;
+    qint64 bytes = 0;
+    for (const QString &path : arguments.mid(1)) {
+        QFile file(path);
+        if (!file.open(QIODevice::ReadOnly)) {
+            err << "cannot read " << path << ": " << file.errorString() << "\n";
+            return 1;
+        }
+
+        PayloadSplitter splitter(&file, calendar);
+        SplitItem item;
+        while (splitter.next(&item)) {
+            ++items;
+            bytes += item.payload.size();
+            auto existing = pending.find(item.uid);
+            if (existing == pending.end() && calendar && written.contains(item.uid)) {
+                // The rest of the series went out with an earlier batch;
+                // read it back and write it again along with this component
+                // rather than overwrite it.
+                finishWrite();
+                SplitItem earlier = item;
+                earlier.payload.clear();
+                readEntry(decsyncDir, type.toUtf8(), collection.section(QPATHSEP, 1).toUtf8(),
+                          appId, QString::fromUtf8(item.uid),
+                          [&earlier](const QString &, const QByteArray &payload) {
+                              earlier.payload = payload;
+                          });
+                if (earlier.payload.isEmpty()) {
+                    err << "cannot add a recurrence exception to " << item.uid << ", skipping it\n";
+                    ++failures;
+                    continue;
+                }
+                order << item.uid;
+                existing = pending.insert(item.uid, earlier);
+            }
+            if (existing != pending.end() && calendar) {
+                // Recurrence exceptions share the UID of their series and
+                // belong in the same VCALENDAR.
+                existing->payload.insert(existing->payload.lastIndexOf("END:VCALENDAR"),
+                                         item.component);
+                continue;
+            }
+            if (existing == pending.end()) {
+                order << item.uid;
+            }
+            pending.insert(item.uid, item);
+            if (order.size() >= batchSize) {
+                writeBatch();
+                err << "imported " << items << " items\n";
+            }
+        }
+    }
+    if (!order.isEmpty() || !extra.isEmpty()) {
+        writeBatch();
+    }
+    finishWrite();
+
+    const double seconds = qMax(timer.nsecsElapsed(), Q_INT64_C(1)) / 1e9;
+    out << "imported " << items << " items (" << bytes / 1024 << " KiB) in "
+        << seconds << " s: " << qRound64(items / seconds) << " items/s, "
+        << bytes / seconds / (1024 * 1024) << " MiB/s\n";
+    if (failures) {
+        err << failures << " batches or items could not be written\n";
+        return 1;
+    }
+    return 0;
+}
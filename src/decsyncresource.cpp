@@ -16,46 +16,323 @@
  */
 
 #include "decsyncresource.h"
+#include "allocationaccounting.h"
+#include "checkpointstore.h"
+#include "decsyncwriter.h"
+#include "iotuner.h"
+#include "metrics.h"
+#include "mirrorstore.h"
+#include "payloadstore.h"
+#include "prefetch.h"
+#include "replay.h"
+#include "slicescheduler.h"
+#include "startupprofile.h"
+#include "statsstore.h"
+#include "task.h"
+#include "threadpriority.h"
+#include "typedpayload.h"
+#include "verifier.h"
 
 #include "../build/src/settings.h"
 #include "../build/src/settingsadaptor.h"
 #include "../build/src/debug.h"
 
+#include <QColor>
 #include <QDBusConnection>
 #include <QUrl>
 #include <QFileDialog>
 #include <QHostInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QPointer>
+#include <QStandardPaths>
+#include <QTimer>
+#include <QUuid>
+#include <QtConcurrent>
+
+#include <AttributeFactory>
+#include <CollectionColorAttribute>
+#include <CollectionFetchJob>
+#include <ChangeRecorder>
+#include <CollectionFetchScope>
+#include <ItemFetchScope>
+#include <ItemSync>
+
+#include <algorithm>
+#include <ctime>
 
 #include <KLocalizedString>
 
 #include <libdecsync.h>
 
+// Rights of the collections holding items, unless the offline mirror is
+// served.
+static const Akonadi::Collection::Rights COLLECTION_RIGHTS =
+    Akonadi::Collection::Right::CanChangeCollection | Akonadi::Collection::Right::CanDeleteCollection |
+    Akonadi::Collection::Right::CanCreateItem | Akonadi::Collection::Right::CanChangeItem |
+    Akonadi::Collection::Right::CanDeleteItem;
+
 DecSyncResource::DecSyncResource(const QString &id)
     : ResourceBase(id)
 {
+    StartupProfile::self()->mark(QStringLiteral("DecSyncResource constructor"));
+    if (Settings::self()->profileStartup()) {
+        StartupProfile::self()->setReportPath(dataDirectory() + QStringLiteral("/startup-profile.txt"));
+    }
+
     new SettingsAdaptor(Settings::self());
     QDBusConnection::sessionBus().registerObject(
         QStringLiteral("/Settings"),
         Settings::self(),
         QDBusConnection::ExportAdaptors);
+    QDBusConnection::sessionBus().registerObject(
+        QStringLiteral("/Metrics"),
+        Metrics::self(),
+        QDBusConnection::ExportScriptableSlots);
+    this->stats = new StatsStore(dataDirectory() + QStringLiteral("/stats"), this);
+    QDBusConnection::sessionBus().registerObject(
+        QStringLiteral("/Stats"),
+        this->stats,
+        QDBusConnection::ExportScriptableSlots);
+#ifdef DECSYNC_ALLOCATION_ACCOUNTING
+    QDBusConnection::sessionBus().registerObject(
+        QStringLiteral("/Allocations"),
+        AllocationAccounting::self(),
+        QDBusConnection::ExportScriptableSlots);
+#endif
 
     setNeedsNetwork(false);
 
-    const int versionStatus = decsync_check_decsync_info(
-        qUtf8Printable(Settings::self()->decSyncDirectory()));
-    setOnline(!versionStatus);
-    if (versionStatus) {
+    // Changed items are written to DecSync as a whole, so get their payload
+    // and the remote ID of their collection along with change notifications.
+    changeRecorder()->itemFetchScope().fetchFullPayload(true);
+    changeRecorder()->itemFetchScope().setAncestorRetrieval(Akonadi::ItemFetchScope::Parent);
+
+    this->sliceScheduler = new SliceScheduler(this);
+    this->sliceScheduler->setBudget(Settings::self()->mainThreadSliceBudget());
+    connect(this, &Akonadi::ResourceBase::synchronized, this, [this]() {
+        this->inFullSync = false;
+    });
+    // Akonadi reports the progress of committing the items handed over to
+    // it, at most once a second, so this measures the commit time of a
+    // retrieval to within about that much.
+    // Committing items that fails is reported as an error.
+    connect(this, &Akonadi::AgentBase::error, this, [this]() {
+        this->itemSyncFailed = true;
+    });
+    connect(this, &Akonadi::AgentBase::percent, this, [this](int progress) {
+        if (progress < 100 || !this->itemSyncTimer.isValid()) {
+            return;
+        }
+        const qint64 msecs = this->itemSyncTimer.elapsed();
+        qCDebug(log_decsyncresource, "%s: Akonadi committed %d items in %lld ms",
+                qUtf8Printable(this->itemSyncCollection), this->itemSyncItems, msecs);
+        Metrics::self()->set(QStringLiteral("itemSyncCommitMsecs"), msecs);
+        if (this->itemSyncItems > 0) {
+            Metrics::self()->set(QStringLiteral("itemSyncCommitMsecsPer10k"),
+                                 msecs * 10000 / this->itemSyncItems);
+        }
+        this->itemSyncTimer.invalidate();
+    });
+
+    configureBackgroundPriority(Settings::self()->backgroundNiceness(),
+                                Settings::self()->backgroundIdleIo());
+
+    this->checkpoints = new CheckpointStore(dataDirectory() + QStringLiteral("/checkpoints"));
+    this->mirror = new MirrorStore(dataDirectory() + QStringLiteral("/mirror"));
+    this->reconnectTimer = new QTimer(this);
+    this->reconnectTimer->setInterval(60 * 1000);
+    connect(this->reconnectTimer, &QTimer::timeout, this, &DecSyncResource::checkReconnected);
+
+    // Checking the DecSync directory and looking up the app ID, which needs
+    // the host name, are left to the first sync, so that the resource
+    // registers with Akonadi right away.
+    this->appId = Settings::self()->appId().toUtf8();
+    setOnline(true);
+
+    Akonadi::AttributeFactory::registerAttribute<Akonadi::CollectionColorAttribute>();
+    this->writer = new DecSyncWriter(dataDirectory() + QStringLiteral("/spool"), this);
+    this->writer->setTarget(Settings::self()->decSyncDirectory(), this->appId);
+    connect(this->writer, &DecSyncWriter::flushed,
+            this, [this](const QString &collectionRemoteId, int result) {
+                if (result) {
+                    Q_EMIT this->error(i18n("Could not save changes to %1", collectionRemoteId));
+                }
+            });
+
+    // The verifier is started once the resource is initialized.
+    this->verifier = new Verifier(identifier(), this->checkpoints, this->stats, this);
+    this->verifier->setBudget(Settings::self()->verifyBudget() * Q_INT64_C(1024 * 1024));
+    connect(this->verifier, &Verifier::driftDetected,
+            this, [this](const Akonadi::Collection &collection) {
+                // Make sure the collection is replayed even if its directory
+                // looks unchanged, and that all items are delivered rather
+                // than only those that changed since the last replay. Items
+                // whose hash still matches their remote revision aren't
+                // rewritten.
+                Checkpoint checkpoint = this->checkpoints->get(collection.remoteId());
+                checkpoint.signature.clear();
+                checkpoint.itemHashes.clear();
+                this->checkpoints->put(collection.remoteId(), checkpoint);
+                synchronizeCollection(collection.id());
+            });
+}
+
+/**
+ * Gets the directory the resource keeps its own data in, such as checkpoints
+ * and the offline mirror.
+ */
+QString DecSyncResource::dataDirectory() const
+{
+    return QStandardPaths::writableLocation(QStandardPaths::GenericDataLocation) +
+        QStringLiteral("/akonadi/") + identifier();
+}
+
+/**
+ * Checks the DecSync directory and gets the app ID, unless it's cached. This
+ * is called on a worker thread, so it mustn't touch the resource.
+ */
+static DecSyncStatus checkDecSync(const QString &decsyncDir, const QByteArray &cachedAppId,
+                                  const MirrorStore* mirror, bool offlineMirror)
+{
+    DecSyncStatus status { decsync_check_decsync_info(qUtf8Printable(decsyncDir)),
+                           cachedAppId, false, StartupProfile::now(), 0 };
+    if (status.appId.isEmpty()) {
+        char appId[APPID_LENGTH];
+        decsync_get_app_id("akonadi", appId, APPID_LENGTH);
+        status.appId = QByteArray(appId);
+        status.appIdAt = StartupProfile::now();
+    }
+    status.hasMirror = status.versionStatus && offlineMirror && !mirror->collections().isEmpty();
+    return status;
+}
+
+/**
+ * Calls callback once the resource is initialized, initializing it on a
+ * worker thread first if needed. ready is false if the DecSync directory
+ * turned out unusable and there's no offline mirror either; the next call
+ * then checks again.
+ */
+void DecSyncResource::whenInitialized(const std::function<void(bool ready)> &callback)
+{
+    if (this->initialized) {
+        callback(true);
+        return;
+    }
+    this->pendingInitialization << callback;
+    if (this->pendingInitialization.size() > 1) {
+        // Already being initialized.
+        return;
+    }
+
+    const QString decsyncDir = Settings::self()->decSyncDirectory();
+    const QByteArray cachedAppId = this->appId;
+    const MirrorStore* mirror = this->mirror;
+    const bool offlineMirror = Settings::self()->offlineMirror();
+    runTask(QThreadPool::globalInstance(), [=]() {
+        return checkDecSync(decsyncDir, cachedAppId, mirror, offlineMirror);
+    }).then(this, [this](const DecSyncStatus &checked) {
+        finishInitialization(checked);
+    });
+}
+
+void DecSyncResource::finishInitialization(const DecSyncStatus &checked)
+{
+    StartupProfile::self()->mark(QStringLiteral("decsync_check_decsync_info"), checked.checkedAt);
+    if (checked.appIdAt) {
+        StartupProfile::self()->mark(QStringLiteral("decsync_get_app_id"), checked.appIdAt);
+    }
+    StartupProfile::self()->mark(QStringLiteral("initialized"));
+    if (this->appId != checked.appId) {
+        this->appId = checked.appId;
+        Settings::self()->setAppId(QString::fromUtf8(this->appId));
+        Settings::self()->save();
+        this->writer->setTarget(Settings::self()->decSyncDirectory(), this->appId);
+    }
+    qCDebug(log_decsyncresource, "resource initialized with app ID %s", this->appId.constData());
+
+    if (checked.versionStatus && checked.hasMirror) {
+        enterMirrorMode();
+    } else if (checked.versionStatus) {
         const char* errorMessage =
-            versionStatus == 1 ? "libdecsync: %s: found invalid .decsync-version" :
-            versionStatus == 2 ? "libdecsync: %s: unsupported version" :
+            checked.versionStatus == 1 ? "libdecsync: %s: found invalid .decsync-version" :
+            checked.versionStatus == 2 ? "libdecsync: %s: unsupported version" :
             "libdecsync: %s: unknown error";
         Q_EMIT status(Akonadi::AgentBase::Status::Broken, QString::fromUtf8(errorMessage));
         qCCritical(log_decsyncresource, "%s", errorMessage);
+    }
+    this->initialized = !checked.versionStatus || this->mirrorMode;
+    if (this->initialized) {
+        this->verifier->setAppId(this->appId);
+        this->verifier->setInterval(Settings::self()->verifyInterval());
+    }
+
+    // Go offline first, so that changes deferred meanwhile wait for the
+    // next attempt rather than coming right back.
+    if (!this->initialized) {
         setTemporaryOffline(60);
     }
+    const auto callbacks = this->pendingInitialization;
+    this->pendingInitialization.clear();
+    for (const auto &callback : callbacks) {
+        callback(this->initialized);
+    }
+}
 
-    decsync_get_app_id("akonadi", this->appId, APPID_LENGTH);
-    qCDebug(log_decsyncresource, "resource started with app ID %s", this->appId);
+/**
+ * Switches to serving the offline mirror, because the DecSync directory is
+ * unavailable. The resource stays online, but only lists what the mirror
+ * holds, keeps changes in the writer's spool, and checks every minute
+ * whether the directory is back.
+ */
+void DecSyncResource::enterMirrorMode()
+{
+    qCInfo(log_decsyncresource, "DecSync directory unavailable, serving offline mirror");
+    this->mirrorMode = true;
+    this->writer->setHeld(true);
+    setOnline(true);
+    Q_EMIT status(Akonadi::AgentBase::Status::Idle,
+                  i18n("DecSync folder unavailable, showing offline copy"));
+    this->reconnectTimer->start();
+}
+
+/**
+ * Checks whether the DecSync directory is available again, and leaves mirror
+ * mode if so.
+ */
+void DecSyncResource::checkReconnected()
+{
+    // While the directory is unavailable, e.g. on a stale network mount,
+    // looking at it may block for a long time, so do it on a worker thread,
+    // and only one check at a time.
+    if (this->checkingReconnected) {
+        return;
+    }
+    this->checkingReconnected = true;
+    const QString decsyncDir = Settings::self()->decSyncDirectory();
+    runTask(QThreadPool::globalInstance(), [decsyncDir]() {
+        return decsync_check_decsync_info(qUtf8Printable(decsyncDir));
+    }).then(this, [this](int versionStatus) {
+        this->checkingReconnected = false;
+        if (!versionStatus && this->mirrorMode) {
+            // Thanks to the checkpoints, only collections that changed while
+            // we were away are replayed.
+            qCInfo(log_decsyncresource, "DecSync directory available again, reconciling");
+            leaveMirrorMode();
+            synchronize();
+        }
+    });
+}
+
+/**
+ * Stops serving the offline mirror, and writes the changes made meanwhile.
+ */
+void DecSyncResource::leaveMirrorMode()
+{
+    this->reconnectTimer->stop();
+    this->mirrorMode = false;
+    this->writer->setHeld(false);
+    Q_EMIT status(Akonadi::AgentBase::Status::Idle, QString());
 }
 
 /**
@@ -87,13 +364,51 @@ void DecSyncResource::configure(WId windowId)
         return;
     }
 
+    // Changes still pending belong to the old directory; those that can't
+    // be written there, e.g. because it's unavailable, are dropped.
+    this->writer->flush();
+    this->writer->setTarget(newPath, this->appId);
     Settings::self()->setDecSyncDirectory(newPath);
     Settings::self()->save();
+    // The new directory is usable, so the old one's mirror isn't needed
+    // anymore; syncing it after it's cleared would make Akonadi drop every
+    // collection.
+    if (this->mirrorMode) {
+        leaveMirrorMode();
+    }
+    this->checkpoints->clear();
+    this->stats->clear();
+    this->mirror->clear();
     synchronize();
     configurationDialogAccepted();
 }
 
-DecSyncResource::~DecSyncResource() {}
+DecSyncResource::~DecSyncResource()
+{
+    delete this->checkpoints;
+    delete this->mirror;
+}
+
+/**
+ * Called when the user aborts the current task. Stops a running item
+ * retrieval, whether it's still replaying or already handing over items.
+ */
+void DecSyncResource::abortActivity()
+{
+    // Akonadi may be cancelling the commit of the last retrieval's items.
+    this->itemSyncFailed = true;
+    if (!this->retrieval) {
+        return;
+    }
+    // Deleting the context right away, rather than later, makes sure a
+    // pending continuation can't run anymore.
+    delete this->retrieval;
+    this->retrieval = nullptr;
+    this->sliceScheduler->clear();
+    ACCOUNT_RELEASE(Decoding, this->retrievalDecodedBytes);
+    this->retrievalDecodedBytes = 0;
+    cancelTask(i18n("Aborted"));
+}
 
 /**
  * Any cleanup you need to do while there is still an active event loop. The
@@ -117,27 +432,78 @@ const QStringList appropriateMimetypes(const char* collectionType)
     }
 }
 
-void DecSyncResource::retrieveCollections()
+/**
+ * Reads a value from the static info of the given collection. The key is
+ * given JSON-encoded, as libdecsync wants it.
+ */
+static QJsonValue readStaticInfo(const QString &decsyncDir, const char* type,
+                                 const QByteArray &name, const char* key)
 {
-    Akonadi::Collection::List collections;
+    char value[FRIENDLY_NAME_LENGTH];
+    {
+        IoTuner::Measurement measurement;
+        decsync_get_static_info(qUtf8Printable(decsyncDir), type, name.constData(),
+                                key, value, FRIENDLY_NAME_LENGTH);
+    }
+    // value contains a JSON-encoded value, not the actual value! Wrap it in
+    // [ ] so QJsonDocument can decode it.
+    QByteArray array = QByteArray(value).prepend('[').append(']');
+    return QJsonDocument::fromJson(array).array().first();
+}
 
-    if (Settings::self()->decSyncDirectory().isEmpty()) {
-        collectionsRetrieved(collections);
-        return;
+/**
+ * Opens the given collection, initializes its stored entries and reads its
+ * friendly name, colour and deletion flag from the static info. The friendly
+ * name is null if the collection couldn't be opened. This is called on
+ * background worker threads, so it mustn't touch the resource.
+ */
+static ListedCollection initializeCollection(const QString &decsyncDir, const char* type,
+                                             const QByteArray &name, const QByteArray &appId)
+{
+    enterBackgroundPriority();
+    qCDebug(log_decsyncresource, "initialize %s collection %s", type, name.constData());
+    ListedCollection listed { QByteArray(type), name, QString(), QString(), false };
+    Decsync sync;
+    {
+        IoTuner::Measurement measurement;
+        if (int error = decsync_new(&sync, qUtf8Printable(decsyncDir), type,
+                                    name.constData(), appId.constData())) {
+            qCWarning(log_decsyncresource,
+                      "failed to initialize DecSync %s collection %s: error %d",
+                      type, name.constData(), error);
+            return listed;
+        }
+    }
+    {
+        IoTuner::Measurement measurement;
+        decsync_init_stored_entries(sync);
     }
+    decsync_free(sync);
 
-    for (const char* type : COLLECTION_TYPES) {
-        const QString qTypeName = QString::fromUtf8(type);
+    listed.friendlyName = readStaticInfo(decsyncDir, type, name, "\"name\"")
+        .toString(QStringLiteral(""));
+    listed.color = readStaticInfo(decsyncDir, type, name, "\"color\"").toString();
+    listed.deleted = readStaticInfo(decsyncDir, type, name, "\"deleted\"").toBool();
+    return listed;
+}
 
-        Akonadi::Collection parentColl;
-        parentColl.setParentCollection(Akonadi::Collection::root());
-        parentColl.setRemoteId(qTypeName + QPATHSEP);
-        // Allow subcollections only.
-        parentColl.setContentMimeTypes({ QStringLiteral("inode/directory") });
-        parentColl.setRights(Akonadi::Collection::Right::CanCreateCollection);
-        parentColl.setName(QStringLiteral("DecSync ") + qTypeName);
-        collections << parentColl;
+/**
+ * Lists the DecSync collections of all types and opens them. Disabled
+ * collections aren't opened, but listed with the name cached in their
+ * checkpoint. This is called on a worker thread, so it mustn't touch the
+ * resource.
+ */
+static QVector<ListedCollection> listCollections(const QString &decsyncDir,
+                                                 const QByteArray &appId,
+                                                 bool prefetch,
+                                                 const QSet<QString> &disabled,
+                                                 const CheckpointStore* checkpoints,
+                                                 const StatsStore* stats)
+{
+    QVector<ListedCollection> results;
+    QVector<QFuture<ListedCollection>> listed;
 
+    for (const char* type : COLLECTION_TYPES) {
         QByteArray backingStore[MAX_COLLECTIONS];
         const char* names[MAX_COLLECTIONS];
         // Allocate and fill the new array with zeros so
@@ -153,77 +519,220 @@ void DecSyncResource::retrieveCollections()
         }
 
         int collectionsFound = decsync_list_decsync_collections(
-            qUtf8Printable(Settings::self()->decSyncDirectory()),
-            type, names, MAX_COLLECTIONS);
+            qUtf8Printable(decsyncDir), type, names, MAX_COLLECTIONS);
         qCDebug(log_decsyncresource, "found %d/%d collections for %s",
                 collectionsFound, MAX_COLLECTIONS, type);
 
+        QVector<QByteArray> enabled;
         for (int i = 0; i < collectionsFound; ++i) {
-            qCDebug(log_decsyncresource, "initialize %s collection %s", type, names[i]);
-            Decsync sync;
-            if (int error = decsync_new(
-                    &sync, qUtf8Printable(Settings::self()->decSyncDirectory()),
-                    type, names[i], this->appId)) {
-                qCWarning(log_decsyncresource,
-                          "failed to initialize DecSync %s collection %s: error %d",
-                          type, names[i], error);
+            const QByteArray name(names[i]);
+            const QString remoteId = QString::fromUtf8(type) + QPATHSEP + QString::fromUtf8(name);
+            if (!disabled.contains(remoteId)) {
+                enabled << name;
                 continue;
             }
-            decsync_init_stored_entries(sync);
-
-            // TODO: Read calendar colour from static info.
-            Akonadi::Collection coll;
-            coll.setParentCollection(parentColl);
-            coll.setRemoteId(qTypeName + QPATHSEP + QString::fromUtf8(names[i]));
-            coll.setContentMimeTypes(appropriateMimetypes(type));
-            coll.setRights(Akonadi::Collection::Right::ReadOnly);
-
-            char friendlyName[FRIENDLY_NAME_LENGTH];
-            decsync_get_static_info(
-                qUtf8Printable(Settings::self()->decSyncDirectory()),
-                type, names[i], "\"name\"", friendlyName, FRIENDLY_NAME_LENGTH);
+            const QString cachedName = checkpoints->get(remoteId).name;
+            results.append({ QByteArray(type), name,
+                             cachedName.isNull() ? QString::fromUtf8(name) : cachedName,
+                             QString(), false });
+        }
 
-            // friendlyName contains a JSON-encoded string, not the actual
-            // value! Wrap it in [ ] so QJsonDocument can decode it.
-            QByteArray array = QByteArray(friendlyName).prepend('[').append(']');
-            coll.setName(QJsonDocument::fromJson(array).array().first().toString());
+        // Open collections that often change first, then small ones before
+        // big ones, so what's likely new shows up early. Collections never
+        // synced before count as small.
+        const QString typePrefix = QString::fromUtf8(type) + QPATHSEP;
+        std::stable_sort(enabled.begin(), enabled.end(),
+                         [&](const QByteArray &a, const QByteArray &b) {
+            const CollectionStats statsA = stats->get(typePrefix + QString::fromUtf8(a));
+            const CollectionStats statsB = stats->get(typePrefix + QString::fromUtf8(b));
+            if (statsA.isHot() != statsB.isHot()) {
+                return statsA.isHot();
+            }
+            return statsA.entries < statsB.entries;
+        });
 
-            collections << coll;
+        // Opening a collection reads its stored entries, so start the
+        // prefetch first. Akonadi will also ask for their items next.
+        if (prefetch) {
+            for (const QByteArray &name : enabled) {
+                schedulePrefetch(collectionDirectory(decsyncDir, type, name.constData()));
+            }
+        }
 
-            decsync_free(sync);
+        // On slow folders, opening collections one after the other is
+        // latency-bound, so let the I/O tuner decide how many to open at once.
+        for (const QByteArray &name : enabled) {
+            listed << QtConcurrent::run(
+                IoTuner::self()->collectionPool(),
+                [decsyncDir, type, name, appId]() {
+                    return initializeCollection(decsyncDir, type, name, appId);
+                });
         }
+    }
 
+    // This thread isn't in the collection pool, so waiting can't deadlock.
+    for (const QFuture<ListedCollection> &collection : listed) {
+        results << collection.result();
     }
-    collectionsRetrieved(collections);
+    return results;
 }
 
-void onEntryUpdate(const char** path, const int len, const char* datetime,
-                   const char* key, const char* value, void* extra)
+void DecSyncResource::retrieveCollections()
 {
-    // value contains a JSON-encoded string, not the actual value!
-    // Wrap it in [ ] so QJsonDocument can decode it.
-    QByteArray arrayified = QByteArray(value).prepend('[').append(']');
-    QJsonValue payload = QJsonDocument::fromJson(arrayified).array().first();
-    if (payload.isNull()) {
-        // This item is deleted. Do nothing.
+    // Akonadi retrieves every collection's items after this.
+    this->inFullSync = true;
+
+    if (Settings::self()->decSyncDirectory().isEmpty()) {
+        collectionsRetrieved({});
         return;
     }
 
-    QStringList pathComponents;
-    for (int i = 0; i < len; ++i) {
-        pathComponents << QString::fromUtf8(path[i]);
+    if (!this->initialized) {
+        whenInitialized([this](bool ready) {
+            if (ready) {
+                retrieveCollections();
+            } else {
+                cancelTask(i18n("DecSync folder unusable"));
+            }
+        });
+        return;
     }
-    QString remoteId = pathComponents.join(QPATHSEP);
 
-    qCDebug(log_decsyncresource, "got update notification: path=%s datetime=%s key=%s",
-            qUtf8Printable(remoteId), datetime, key);
+    if (this->mirrorMode) {
+        QVector<ListedCollection> listed;
+        const QStringList remoteIds = this->mirror->collections();
+        for (const QString &remoteId : remoteIds) {
+            const QString name = remoteId.section(QPATHSEP, 1);
+            const QString friendlyName = this->checkpoints->get(remoteId).name;
+            listed.append({ remoteId.section(QPATHSEP, 0, 0).toUtf8(), name.toUtf8(),
+                            friendlyName.isNull() ? name : friendlyName, QString(), false });
+        }
+        deliverCollections(listed);
+        return;
+    }
 
-    ItemListAndMime* info = static_cast<ItemListAndMime*>(extra);
-    Akonadi::Item item;
-    item.setRemoteId(remoteId);
-    item.setMimeType(info->mime);
-    item.setPayloadFromData(payload.toString().toUtf8());
-    info->items << item;
+    // Collections just created or deleted may still be waiting in the
+    // writer; listing without them would make Akonadi undo those changes.
+    this->writer->flush([this](bool written) {
+        if (!written) {
+            // The writer tries again later.
+            cancelTask(i18n("Could not save changes to the DecSync folder"));
+            return;
+        }
+        listCollectionsToSync();
+    });
+}
+
+/**
+ * Lists the collections in the DecSync directory, syncing only those that
+ * aren't disabled, and hands them to Akonadi.
+ */
+void DecSyncResource::listCollectionsToSync()
+{
+    // Collections can be disabled in the settings, or by not syncing them
+    // in Akonadi. Only the latter needs asking Akonadi first.
+    auto* job = new Akonadi::CollectionFetchJob(Akonadi::Collection::root(),
+                                                Akonadi::CollectionFetchJob::Recursive, this);
+    job->fetchScope().setResource(identifier());
+    job->fetchScope().setListFilter(Akonadi::CollectionFetchScope::NoFilter);
+    connect(job, &KJob::result, this, [this](KJob* fetchJob) {
+        QSet<QString> disabled;
+        for (const QString &remoteId : Settings::self()->disabledCollections()) {
+            disabled << remoteId;
+        }
+        if (fetchJob->error()) {
+            qCWarning(log_decsyncresource, "failed to fetch sync preferences: %s",
+                      qUtf8Printable(fetchJob->errorString()));
+        } else {
+            const auto known = static_cast<Akonadi::CollectionFetchJob*>(fetchJob)->collections();
+            for (const Akonadi::Collection &collection : known) {
+                if (!collection.shouldList(Akonadi::Collection::ListSync)) {
+                    disabled << collection.remoteId();
+                }
+            }
+        }
+
+        const QString decsyncDir = Settings::self()->decSyncDirectory();
+        const QByteArray appIdCopy = this->appId;
+        const bool prefetch = Settings::self()->prefetchEntries();
+        const CheckpointStore* checkpoints = this->checkpoints;
+        const StatsStore* stats = this->stats;
+        runTask(QThreadPool::globalInstance(), [=]() {
+            return listCollections(decsyncDir, appIdCopy, prefetch, disabled, checkpoints, stats);
+        }).then(this, [this](const QVector<ListedCollection> &listed) {
+            deliverCollections(listed);
+        });
+    });
+}
+
+/**
+ * Turns the listed collections into Akonadi collections below one parent per
+ * collection type, and hands them to Akonadi.
+ */
+void DecSyncResource::deliverCollections(const QVector<ListedCollection> &listed)
+{
+    Akonadi::Collection::List collections;
+    QHash<QByteArray, Akonadi::Collection> parents;
+
+    for (const char* type : COLLECTION_TYPES) {
+        const QString qTypeName = QString::fromUtf8(type);
+
+        Akonadi::Collection parentColl;
+        parentColl.setParentCollection(Akonadi::Collection::root());
+        parentColl.setRemoteId(qTypeName + QPATHSEP);
+        // Allow subcollections only.
+        parentColl.setContentMimeTypes({ QStringLiteral("inode/directory") });
+        parentColl.setRights(this->mirrorMode ?
+                             Akonadi::Collection::Rights(Akonadi::Collection::Right::ReadOnly) :
+                             Akonadi::Collection::Right::CanCreateCollection);
+        parentColl.setName(QStringLiteral("DecSync ") + qTypeName);
+        collections << parentColl;
+        parents.insert(type, parentColl);
+    }
+
+    // The offline mirror can't be written back to DecSync.
+    const Akonadi::Collection::Rights rights = this->mirrorMode ?
+        Akonadi::Collection::Rights(Akonadi::Collection::Right::ReadOnly) : COLLECTION_RIGHTS;
+
+    for (const ListedCollection &listedColl : listed) {
+        if (listedColl.friendlyName.isNull() || listedColl.deleted) {
+            continue;
+        }
+
+        Akonadi::Collection coll;
+        coll.setParentCollection(parents.value(listedColl.type));
+        coll.setRemoteId(QString::fromUtf8(listedColl.type) + QPATHSEP +
+                         QString::fromUtf8(listedColl.name));
+        coll.setContentMimeTypes(appropriateMimetypes(listedColl.type.constData()));
+        coll.setRights(rights);
+        coll.setName(listedColl.friendlyName);
+        if (!listedColl.color.isEmpty()) {
+            coll.addAttribute(new Akonadi::CollectionColorAttribute(QColor(listedColl.color)));
+        }
+        collections << coll;
+
+        Checkpoint checkpoint = this->checkpoints->get(coll.remoteId());
+        if (checkpoint.name != listedColl.friendlyName) {
+            checkpoint.name = listedColl.friendlyName;
+            this->checkpoints->put(coll.remoteId(), checkpoint);
+        }
+    }
+
+    if (this->mirrorMode) {
+        // The mirror only has collections synced before, and not disabled
+        // ones; leave the others to Akonadi rather than have it remove them.
+        collectionsRetrievedIncremental(collections, Akonadi::Collection::List());
+    } else {
+        collectionsRetrieved(collections);
+    }
+    StartupProfile::self()->mark(QStringLiteral("first collectionsRetrieved"));
+    QStringList remoteIds;
+    for (const Akonadi::Collection &collection : collections) {
+        if (!collection.remoteId().endsWith(QPATHSEP)) {
+            remoteIds << collection.remoteId();
+        }
+    }
+    StartupProfile::self()->expectCollections(remoteIds);
 }
 
 void DecSyncResource::retrieveItems(const Akonadi::Collection &collection)
@@ -233,84 +742,825 @@ void DecSyncResource::retrieveItems(const Akonadi::Collection &collection)
     // each item, remote ID and MIME type are enough at this stage.
     qCDebug(log_decsyncresource, "retrieveItems");
 
+    if (!this->initialized) {
+        whenInitialized([this, collection](bool ready) {
+            if (ready) {
+                retrieveItems(collection);
+            } else {
+                cancelTask(i18n("DecSync folder unusable"));
+            }
+        });
+        return;
+    }
+
     const QList<QByteArray> components = collection.remoteId().toUtf8().split(PATHSEP);
-    const char* collType = components[0].constData();
-    const char* collName = components[1].constData();
-    qCDebug(log_decsyncresource, "getting items for %s/%s", collType, collName);
+    const QByteArray collType = components[0];
+    const QByteArray collName = components[1];
+    qCDebug(log_decsyncresource, "getting items for %s/%s",
+            collType.constData(), collName.constData());
 
-    Decsync sync;
-    if (int error = decsync_new(
-            &sync, qUtf8Printable(Settings::self()->decSyncDirectory()),
-            collType, collName, this->appId)) {
-        Q_EMIT status(Akonadi::AgentBase::Status::Broken,
-                      QStringLiteral("failed to initialize DecSync collection"));
-        qCWarning(log_decsyncresource,
-                  "failed to initialize DecSync %s collection %s: error %d",
-                  collType, collName, error);
+    if (!collection.shouldList(Akonadi::Collection::ListSync) ||
+        Settings::self()->disabledCollections().contains(collection.remoteId())) {
+        // Not synced, so leave whatever Akonadi has alone.
+        qCDebug(log_decsyncresource, "skipping disabled collection");
+        itemsRetrievalDone();
+        StartupProfile::self()->collectionReady(collection.remoteId());
         return;
     }
 
-#define PATH_LENGTH 1
-    const char* path[PATH_LENGTH] { "resources" };
-    decsync_add_listener(sync, path, PATH_LENGTH, onEntryUpdate);
+    if (this->mirrorMode && this->writer->hasPending(collection.remoteId())) {
+        // The mirror doesn't know about the changes made since, so syncing
+        // it would undo them; leave what Akonadi has alone.
+        itemsRetrievalDone();
+        StartupProfile::self()->collectionReady(collection.remoteId());
+        return;
+    }
+    if (this->mirrorMode) {
+        const MirrorStore* mirror = this->mirror;
+        const QString remoteId = collection.remoteId();
+        this->retrieval = new QObject(this);
+        runTask(QThreadPool::globalInstance(), [mirror, remoteId]() {
+            return mirror->load(remoteId);
+        }).then(this->retrieval, [=](const QVector<DecodedEntry> &entries) {
+            if (entries.isEmpty()) {
+                // No usable mirror; leave what Akonadi has alone rather than
+                // syncing an empty collection.
+                endRetrieval();
+                itemsRetrievalDone();
+                StartupProfile::self()->collectionReady(remoteId);
+                return;
+            }
+            deliverEntries(collection, entries, QByteArray());
+        });
+        return;
+    }
 
-    Akonadi::Item::List items;
-    ItemListAndMime info(items, appropriateMimetypes(collType).first());
-    decsync_execute_all_stored_entries_for_path_prefix(sync, path, PATH_LENGTH, &info);
-#undef PATH_LENGTH
+    const QString decsyncDir = Settings::self()->decSyncDirectory();
+    const QString collDir = collectionDirectory(decsyncDir, collType.constData(),
+                                                collName.constData());
+    // Replaying is I/O-bound, so keep it off the event loop thread. During
+    // a full sync nobody is waiting for this collection in particular, so
+    // it's done at background priority.
+    const bool background = this->inFullSync;
+    // The prefetch pool runs at background priority, where it would lose
+    // against an interactive replay and only get to the files after it. So
+    // interactive fetches issue the read-ahead hints themselves, right
+    // before replaying.
+    const bool prefetchInline = Settings::self()->prefetchEntries() && !background;
+    if (Settings::self()->prefetchEntries() && background) {
+        schedulePrefetch(collDir);
+    }
+    QThreadPool* pool = background ? IoTuner::self()->collectionPool()
+                                   : QThreadPool::globalInstance();
+    const QByteArray appIdCopy = this->appId;
+    // After a restart, this resumes from the checkpoint written by the last
+    // replay, so unchanged collections don't need a full replay again.
+    const QByteArray previousSignature = this->checkpoints->get(collection.remoteId()).signature;
 
-    decsync_free(sync);
-    itemsRetrieved(items);
+    // Aborting deletes this, which drops the continuation.
+    this->retrieval = new QObject(this);
+    this->retrievalTimer.start();
+    const QPointer<QObject> retrieval = this->retrieval;
+    // Changes to this collection may still be waiting in the writer;
+    // replaying without them would make Akonadi undo them.
+    this->writer->flush([=](bool written) {
+        Q_UNUSED(written);
+        if (!retrieval) {
+            // Aborted meanwhile.
+            return;
+        }
+        if (this->writer->hasPending(collection.remoteId())) {
+            // Writing them failed; the writer tries again later.
+            endRetrieval();
+            cancelTask(i18n("Could not save changes to the DecSync folder"));
+            return;
+        }
+        runTask(pool, [=]() {
+            if (prefetchInline) {
+                prefetchDirectory(collDir);
+            }
+            return replayCollection(decsyncDir, collDir, collType, collName, appIdCopy,
+                                    previousSignature, background);
+        }).then(retrieval.data(), [=](const ReplayResult &result) {
+            // Counted only once the result is here, so that a retrieval aborted
+            // while replaying, whose result is dropped, leaves nothing behind.
+            ACCOUNT_ALLOCATION(Decoding, result.decodedBytes);
+            this->retrievalDecodedBytes = result.decodedBytes;
+            if (result.error) {
+                qCWarning(log_decsyncresource,
+                          "failed to initialize DecSync %s collection %s: error %d",
+                          collType.constData(), collName.constData(), result.error);
+                Q_EMIT status(Akonadi::AgentBase::Status::Broken,
+                              QStringLiteral("failed to initialize DecSync collection"));
+                endRetrieval();
+                cancelTask(QStringLiteral("failed to initialize DecSync collection"));
+            } else if (result.unchanged) {
+                qCDebug(log_decsyncresource, "%s/%s unchanged since last replay",
+                        collType.constData(), collName.constData());
+                this->stats->record(collection.remoteId(), false, 0, 0,
+                                    this->retrievalTimer.elapsed());
+                endRetrieval();
+                itemsRetrievalDone();
+                StartupProfile::self()->collectionReady(collection.remoteId());
+            } else {
+                deliverEntries(collection, result.entries, result.signature);
+            }
+        });
+    });
 }
 
-/*
- * Note that these three functions don't get the full payload of the items by default,
- * you need to change the item fetch scope of the change recorder to fetch the full
- * payload. This can be expensive with big payloads, though.
+/**
+ * Forgets about the running retrieveItems task, once it's done or aborted.
+ */
+void DecSyncResource::endRetrieval()
+{
+    if (this->retrieval) {
+        this->retrieval->deleteLater();
+        this->retrieval = nullptr;
+    }
+    ACCOUNT_RELEASE(Decoding, this->retrievalDecodedBytes);
+    this->retrievalDecodedBytes = 0;
+}
+
+/**
+ * Picks how many items to build per step for a collection whose last sync
+ * yielded the given stats: fewer if its items are big, more if they're small.
+ */
+static int itemsPerSliceStep(const CollectionStats &stats)
+{
+    if (stats.entries <= 0 || stats.bytes <= 0) {
+        return ITEMS_PER_SLICE_STEP;
+    }
+    const qint64 averageBytes = stats.bytes / stats.entries;
+    return int(qBound<qint64>(MIN_ITEMS_PER_SLICE_STEP, BYTES_PER_SLICE_STEP / qMax<qint64>(1, averageBytes),
+                              MAX_ITEMS_PER_SLICE_STEP));
+}
+
+/**
+ * Decides whether to deliver only the changed items of a collection, given
+ * the stats of its previous syncs. Collections that were small last time are
+ * synced in full, which costs hardly more and repairs any drift. So are ones
+ * where most items changed anyway; for collections that rarely change, a
+ * smaller share already counts as most, as such a change is usually a bulk
+ * rewrite by another client rather than the start of a series of edits.
+ */
+static bool preferIncrementalSync(const CollectionStats &stats, int entries, int changed)
+{
+    const int size = stats.entries > 0 ? stats.entries : entries;
+    if (size <= SMALL_COLLECTION_ENTRIES) {
+        return false;
+    }
+    const int maxChanged = stats.isHot() ? entries / 2 : entries / 4;
+    return changed <= maxChanged;
+}
+
+/**
+ * CPU time the calling thread has used so far, in microseconds.
+ */
+static qint64 threadCpuUsecs()
+{
+    struct timespec now;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now) != 0) {
+        return 0;
+    }
+    return qint64(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Publishes the CPU time building items on the event loop thread takes per
+ * 10,000 items, separately for each payload mode so they can be compared.
+ */
+static void recordItemBuildCpu(int payloadMode, int count, qint64 usecs)
+{
+    static const char* const names[] = {
+        "rawItemBuildCpuUsecsPer10k",
+        "parsedItemBuildCpuUsecsPer10k",
+        "parallelParsedItemBuildCpuUsecsPer10k",
+    };
+    const int modes = int(sizeof(names) / sizeof(*names));
+    static qint64 totalUsecs[modes] = {};
+    static qint64 totalItems[modes] = {};
+    if (count == 0 || payloadMode < 0 || payloadMode >= modes) {
+        return;
+    }
+    totalUsecs[payloadMode] += usecs;
+    totalItems[payloadMode] += count;
+    Metrics::self()->set(QString::fromLatin1(names[payloadMode]),
+                         totalUsecs[payloadMode] * 10000 / totalItems[payloadMode]);
+}
+
+/**
+ * Turns the given entries into items and hands them to Akonadi a few at a
+ * time, in slices scheduled on the event loop. An empty signature means the
+ * entries come from the offline mirror rather than a replay.
  *
- * Once you have handled changes in itemAdded() and itemChanged(), call changeCommitted().
- * Once you have handled changes in itemRemoved(), call changeProcessed();
- * These methods are called whenever a local item related to this resource is
- * added, modified or deleted. They are only called if the resource is online, otherwise
- * all changes are recorded and replayed as soon the resource is online again.
+ * If the collection's checkpoint knows the hash of every item as of the last
+ * replay, only items whose hash changed are delivered, along with the ones
+ * that disappeared, unless the collection's stats suggest a full sync (see
+ * preferIncrementalSync()); otherwise all items are, replacing what Akonadi
+ * has.
  */
+void DecSyncResource::deliverEntries(const Akonadi::Collection &collection,
+                                     const QVector<DecodedEntry> &entries,
+                                     const QByteArray &signature)
+{
+    const QString remoteId = collection.remoteId();
+    const QHash<QString, QByteArray> previousHashes = signature.isEmpty() ?
+        QHash<QString, QByteArray>() : this->checkpoints->get(remoteId).itemHashes;
+
+    QHash<QString, QByteArray> hashes;
+    hashes.reserve(entries.size());
+    QVector<DecodedEntry> changed;
+    qint64 bytes = 0;
+    for (const DecodedEntry &entry : entries) {
+        hashes.insert(entry.remoteId, entry.hash);
+        bytes += entry.payload.size();
+        if (previousHashes.value(entry.remoteId) != entry.hash) {
+            changed << entry;
+        }
+    }
+    const CollectionStats known = this->stats->get(remoteId);
+    const bool incremental = !previousHashes.isEmpty() &&
+        preferIncrementalSync(known, entries.size(), changed.size());
+    if (!incremental) {
+        changed = entries;
+    }
+    Akonadi::Item::List removed;
+    if (incremental) {
+        for (auto it = previousHashes.constBegin(); it != previousHashes.constEnd(); ++it) {
+            if (!hashes.contains(it.key())) {
+                Akonadi::Item item;
+                item.setRemoteId(it.key());
+                removed << item;
+            }
+        }
+        qCDebug(log_decsyncresource, "%s: %d of %d items changed, %d removed",
+                qUtf8Printable(remoteId), changed.size(), entries.size(), removed.size());
+    }
+
+    // Hand items over as they're built, instead of all at the end.
+    setItemStreamingEnabled(true);
+    setTotalItems(changed.size() + removed.size());
+
+    const QByteArray collType = remoteId.section(QPATHSEP, 0, 0).toUtf8();
+    const QString mime = appropriateMimetypes(collType.constData()).first();
+    const int step = itemsPerSliceStep(known);
+    configureItemSync(changed.size(), step, !signature.isEmpty() && previousHashes.isEmpty());
+    const int payloadMode = Settings::self()->payloadMode();
+    auto buildSlices = [=](const QVector<TypedPayload> &typed) {
+        this->itemSyncTimer.start();
+        this->itemSyncCollection = remoteId;
+        this->itemSyncItems = changed.size() + removed.size();
+        int position = 0;
+        this->sliceScheduler->schedule([=]() mutable {
+            const int end = qMin(position + step, changed.size());
+            const qint64 cpuStart = threadCpuUsecs();
+            Akonadi::Item::List items;
+            items.reserve(end - position);
+            qint64 itemBytes = 0;
+            for (; position < end; ++position) {
+                Akonadi::Item item;
+                item.setRemoteId(changed[position].remoteId);
+                // Lets Akonadi skip rewriting items whose content didn't change.
+                item.setRemoteRevision(QString::fromLatin1(changed[position].hash.toHex()));
+                item.setMimeType(mime);
+                if (payloadMode == Settings::Raw) {
+                    // A QByteArray payload goes through Akonadi's default
+                    // serializer, which stores the bytes as they are, so the
+                    // vCard or iCalendar data isn't parsed and printed again
+                    // here. The GID a serializer plugin would extract is the
+                    // UID, which is the remote ID.
+                    item.setPayload<QByteArray>(changed[position].payload);
+                    item.setGid(changed[position].remoteId);
+                } else if (position < typed.size() && typed[position].incidence) {
+                    item.setPayload<KCalendarCore::Incidence::Ptr>(typed[position].incidence);
+                    item.setGid(typed[position].uid());
+                } else if (position < typed.size() && typed[position].isValid()) {
+                    item.setPayload<KContacts::Addressee>(typed[position].contact);
+                    item.setGid(typed[position].uid());
+                } else {
+                    // Not parsed ahead, or the parser gave up on it; leave
+                    // it to the serializer plugin.
+                    item.setPayloadFromData(changed[position].payload);
+                }
+                items << item;
+                itemBytes += changed[position].payload.size();
+            }
+            recordItemBuildCpu(payloadMode, items.size(), threadCpuUsecs() - cpuStart);
+            ACCOUNT_ALLOCATION(ItemLists, itemBytes);
+            if (incremental) {
+                itemsRetrievedIncremental(items, position < changed.size() ? Akonadi::Item::List() : removed);
+            } else {
+                itemsRetrieved(items);
+            }
+            ACCOUNT_RELEASE(ItemLists, itemBytes);
+
+            StartupProfile::self()->collectionReady(remoteId);
+
+            if (position < changed.size()) {
+                return false;
+            }
+            endRetrieval();
+            itemsRetrievalDone();
+            // Akonadi has the items now; only payloads still shared with
+            // other collections, caches or pending writes stay in memory.
+            PayloadStore::self()->prune();
+            if (signature.isEmpty()) {
+                // Served from the mirror, so there's nothing new to remember.
+                return true;
+            }
+            this->stats->record(remoteId, true, entries.size(), bytes, this->retrievalTimer.elapsed());
+            // Akonadi is still committing the items, so the checkpoint is
+            // only saved once it's done and didn't report an error; see
+            // confirmCheckpoint().
+            this->unconfirmedCollection = remoteId;
+            this->unconfirmedSignature = signature;
+            this->unconfirmedItemHashes = hashes;
+            this->itemSyncFailed = false;
+            scheduleCustomTask(this, "confirmCheckpoint", remoteId, ResourceBase::Prepend);
+            if (Settings::self()->offlineMirror()) {
+                this->mirror->save(remoteId, entries);
+            }
+            return true;
+        });
+    };
+
+    if (payloadMode == Settings::ParallelParsed && !changed.isEmpty()) {
+        // Parsing is CPU-bound, so do it on all cores up front; the event
+        // loop then only wraps the parsed objects into items.
+        runTask(QThreadPool::globalInstance(), [changed, collType]() {
+            return parsePayloads(changed, collType);
+        }).then(this->retrieval, buildSlices);
+    } else {
+        buildSlices(QVector<TypedPayload>());
+    }
+}
+
+/**
+ * Saves the checkpoint of the retrieval of the given collection, unless
+ * committing its items failed or was aborted. This runs as a custom task
+ * right after the retrieval's task, which ends once Akonadi committed the
+ * items. Should the resource stop before, the collection is replayed on the
+ * next sync rather than taken as unchanged.
+ */
+void DecSyncResource::confirmCheckpoint(const QVariant &collectionRemoteId)
+{
+    const QString remoteId = collectionRemoteId.toString();
+    if (remoteId == this->unconfirmedCollection && !this->itemSyncFailed) {
+        Checkpoint checkpoint = this->checkpoints->get(remoteId);
+        checkpoint.signature = this->unconfirmedSignature;
+        checkpoint.itemHashes = this->unconfirmedItemHashes;
+        this->checkpoints->put(remoteId, checkpoint);
+    } else {
+        qCDebug(log_decsyncresource, "not saving checkpoint of %s, its items weren't committed",
+                qUtf8Printable(remoteId));
+    }
+    this->unconfirmedCollection.clear();
+    this->unconfirmedSignature.clear();
+    this->unconfirmedItemHashes.clear();
+    taskDone();
+}
+
+/**
+ * Sets how Akonadi commits and merges the items of the retrieval about to
+ * start, from the settings or, where they're left automatic, from the number
+ * of items to deliver and whether the collection is synced for the first
+ * time. This has to be done before the first items are handed over.
+ */
+void DecSyncResource::configureItemSync(int items, int step, bool initialSync)
+{
+    Akonadi::ItemSync::TransactionMode transactionMode;
+    switch (Settings::self()->itemTransactionMode()) {
+    case Settings::SingleTransaction:
+        transactionMode = Akonadi::ItemSync::SingleTransaction;
+        break;
+    case Settings::MultipleTransactions:
+        transactionMode = Akonadi::ItemSync::MultipleTransactions;
+        break;
+    case Settings::NoTransaction:
+        transactionMode = Akonadi::ItemSync::NoTransaction;
+        break;
+    default:
+        // A single transaction over tens of thousands of items keeps other
+        // clients waiting until the very end; committing batch by batch
+        // lets them in between. Smaller syncs stay atomic.
+        transactionMode = items > LARGE_COLLECTION_ENTRIES ?
+            Akonadi::ItemSync::MultipleTransactions : Akonadi::ItemSync::SingleTransaction;
+        break;
+    }
+
+    // By default, each step of a slice is one batch.
+    const int batchSize = Settings::self()->itemSyncBatchSize() > 0 ?
+        Settings::self()->itemSyncBatchSize() : step;
+
+    Akonadi::ItemSync::MergeMode mergeMode;
+    switch (Settings::self()->itemMergingMode()) {
+    case Settings::RemoteIdMerge:
+        mergeMode = Akonadi::ItemSync::RIDMerge;
+        break;
+    case Settings::GidMerge:
+        mergeMode = Akonadi::ItemSync::GIDMerge;
+        break;
+    default:
+        // Without a checkpoint, Akonadi may still have items from before,
+        // possibly under other remote IDs; matching them by UID updates
+        // them instead of creating duplicates. Later syncs know the remote
+        // IDs they delivered, so match by those.
+        mergeMode = initialSync ? Akonadi::ItemSync::GIDMerge : Akonadi::ItemSync::RIDMerge;
+        break;
+    }
+
+    setItemTransactionMode(transactionMode);
+    setItemSyncBatchSize(batchSize);
+    setItemMergingMode(mergeMode);
+}
+
+/*
+ * Item changes are queued with the writer and committed once it wrote or
+ * spooled them, like collection changes below, so that bulk changes end up
+ * in one write per collection. Items are stored in DecSync under
+ * ["resources", uid], with their whole payload as the value of the null key;
+ * deleting one sets that value to null.
+ */
+
+/**
+ * Gets the DecSync path of the item with the given remote ID.
+ */
+static QByteArrayList itemPath(const QString &remoteId)
+{
+    // Items not synced since remote IDs were shortened still have the path
+    // as their remote ID.
+    const QString uid = remoteId.startsWith(QLatin1String("resources/")) ?
+        remoteId.mid(int(qstrlen("resources/"))) : remoteId;
+    return { QByteArrayLiteral("resources"), uid.toUtf8() };
+}
+
+/**
+ * Calls callback with the remote IDs of the given collections, by collection
+ * ID. Change notifications usually come with them; those that don't are
+ * fetched first. If that fails, the current task is cancelled.
+ */
+void DecSyncResource::withRemoteIds(const Akonadi::Collection::List &collections,
+                                    const std::function<void(const QHash<Akonadi::Collection::Id, QString> &remoteIds)> &callback)
+{
+    QHash<Akonadi::Collection::Id, QString> remoteIds;
+    for (const Akonadi::Collection &collection : collections) {
+        if (!collection.remoteId().isEmpty()) {
+            remoteIds.insert(collection.id(), collection.remoteId());
+        }
+    }
+    Akonadi::Collection::List missing;
+    QSet<Akonadi::Collection::Id> missingIds;
+    for (const Akonadi::Collection &collection : collections) {
+        const Akonadi::Collection::Id id = collection.id();
+        if (!remoteIds.contains(id) && !missingIds.contains(id)) {
+            missingIds.insert(id);
+            missing << Akonadi::Collection(id);
+        }
+    }
+    if (missing.isEmpty()) {
+        callback(remoteIds);
+        return;
+    }
+
+    auto* fetchJob = new Akonadi::CollectionFetchJob(missing, Akonadi::CollectionFetchJob::Base, this);
+    connect(fetchJob, &KJob::result, this, [this, fetchJob, remoteIds, callback]() mutable {
+        if (fetchJob->error()) {
+            qCWarning(log_decsyncresource, "failed to fetch collections of changed items: %s",
+                      qUtf8Printable(fetchJob->errorString()));
+            cancelTask(i18n("Cannot find the folders of the changed items"));
+            return;
+        }
+        for (const Akonadi::Collection &collection : fetchJob->collections()) {
+            remoteIds.insert(collection.id(), collection.remoteId());
+        }
+        callback(remoteIds);
+    });
+}
+
+/**
+ * Calls callback with the remote IDs of the collections the given items are
+ * in, by collection ID, like withRemoteIds().
+ */
+void DecSyncResource::withCollectionRemoteIds(const Akonadi::Item::List &items,
+                                              const std::function<void(const QHash<Akonadi::Collection::Id, QString> &remoteIds)> &callback)
+{
+    Akonadi::Collection::List collections;
+    collections.reserve(items.size());
+    for (const Akonadi::Item &item : items) {
+        collections << item.parentCollection();
+    }
+    withRemoteIds(collections, callback);
+}
+
+/**
+ * Queues writing the given item's payload to the given collection. Returns
+ * the item with the remote ID and revision it's written under, to commit.
+ */
+Akonadi::Item DecSyncResource::queueItemWrite(const QString &collectionRemoteId,
+                                              const Akonadi::Item &item)
+{
+    const QByteArray payload = item.payloadData();
+    Akonadi::Item written(item);
+    if (written.remoteId().isEmpty()) {
+        // Other DecSync clients store items by their UID, too.
+        written.setRemoteId(!item.gid().isEmpty() ? item.gid() :
+                            QUuid::createUuid().toString(QUuid::WithoutBraces));
+    }
+    written.setRemoteRevision(QString::fromLatin1(itemHash(payload).toHex()));
+    this->writer->setEntry(collectionRemoteId, itemPath(written.remoteId()),
+                           QJsonValue(), QString::fromUtf8(payload));
+    return written;
+}
 
 void DecSyncResource::itemAdded(const Akonadi::Item &item, const Akonadi::Collection &collection)
 {
-    Q_UNUSED(item);
-    Q_UNUSED(collection);
+    if (!this->initialized) {
+        whenInitialized([this, item, collection](bool ready) {
+            if (ready) {
+                itemAdded(item, collection);
+            } else {
+                deferTask();
+            }
+        });
+        return;
+    }
+
+    if (!item.hasPayload()) {
+        cancelTask(i18n("Item has no content to save"));
+        return;
+    }
+    if (collection.remoteId().isEmpty()) {
+        cancelTask(i18n("Cannot find the folder of the added item"));
+        return;
+    }
+
+    const Akonadi::Item written = queueItemWrite(collection.remoteId(), item);
+    qCDebug(log_decsyncresource, "adding item %s to %s",
+            qUtf8Printable(written.remoteId()), qUtf8Printable(collection.remoteId()));
+    commitWhenWritten([this, written]() {
+        changeCommitted(written);
+    });
 }
 
 void DecSyncResource::itemChanged(const Akonadi::Item &item, const QSet<QByteArray> &parts)
 {
-    Q_UNUSED(item);
-    Q_UNUSED(parts);
+    if (!this->initialized) {
+        whenInitialized([this, item, parts](bool ready) {
+            if (ready) {
+                itemChanged(item, parts);
+            } else {
+                deferTask();
+            }
+        });
+        return;
+    }
+
+    // DecSync only stores payloads; other parts, such as attributes, stay
+    // in Akonadi.
+    bool payloadChanged = parts.isEmpty();
+    for (const QByteArray &part : parts) {
+        payloadChanged = payloadChanged || part.startsWith("PLD:");
+    }
+    if (!payloadChanged || !item.hasPayload()) {
+        changeCommitted(item);
+        return;
+    }
+
+    withCollectionRemoteIds({ item }, [this, item](const QHash<Akonadi::Collection::Id, QString> &remoteIds) {
+        const QString collectionRemoteId = remoteIds.value(item.parentCollection().id());
+        if (collectionRemoteId.isEmpty()) {
+            cancelTask(i18n("Cannot find the folder of the changed item"));
+            return;
+        }
+        const Akonadi::Item written = queueItemWrite(collectionRemoteId, item);
+        commitWhenWritten([this, written]() {
+            changeCommitted(written);
+        });
+    });
 }
 
 void DecSyncResource::itemRemoved(const Akonadi::Item &item)
 {
-    Q_UNUSED(item);
+    itemsRemoved({ item });
+}
+
+void DecSyncResource::itemsRemoved(const Akonadi::Item::List &items)
+{
+    if (!this->initialized) {
+        whenInitialized([this, items](bool ready) {
+            if (ready) {
+                itemsRemoved(items);
+            } else {
+                deferTask();
+            }
+        });
+        return;
+    }
+
+    withCollectionRemoteIds(items, [this, items](const QHash<Akonadi::Collection::Id, QString> &remoteIds) {
+        for (const Akonadi::Item &item : items) {
+            if (!item.remoteId().isEmpty() && remoteIds.value(item.parentCollection().id()).isEmpty()) {
+                cancelTask(i18n("Cannot find the folders of the removed items"));
+                return;
+            }
+        }
+
+        qCDebug(log_decsyncresource, "removing %d items", items.size());
+        for (const Akonadi::Item &item : items) {
+            if (item.remoteId().isEmpty()) {
+                // Never made it to DecSync.
+                continue;
+            }
+            this->writer->setEntry(remoteIds.value(item.parentCollection().id()),
+                                   itemPath(item.remoteId()), QJsonValue(), QJsonValue());
+        }
+        commitWhenWritten([this]() {
+            changeProcessed();
+        });
+    });
+}
+
+void DecSyncResource::itemsMoved(const Akonadi::Item::List &items,
+                                 const Akonadi::Collection &sourceCollection,
+                                 const Akonadi::Collection &destinationCollection)
+{
+    if (!this->initialized) {
+        whenInitialized([this, items, sourceCollection, destinationCollection](bool ready) {
+            if (ready) {
+                itemsMoved(items, sourceCollection, destinationCollection);
+            } else {
+                deferTask();
+            }
+        });
+        return;
+    }
 
-    // To delete a contact or calendar event, set its DecSync value to JSON null.
+    for (const Akonadi::Item &item : items) {
+        if (!item.hasPayload()) {
+            cancelTask(i18n("Item has no content to save"));
+            return;
+        }
+    }
+
+    withRemoteIds({ sourceCollection, destinationCollection },
+                  [this, items, sourceCollection, destinationCollection](const QHash<Akonadi::Collection::Id, QString> &remoteIds) {
+        const QString source = remoteIds.value(sourceCollection.id());
+        const QString destination = remoteIds.value(destinationCollection.id());
+        if (source.isEmpty() || destination.isEmpty()) {
+            cancelTask(i18n("Cannot find the folders of the moved items"));
+            return;
+        }
+
+        // DecSync has no moves; the items are deleted from the source
+        // collection and written to the destination under the same UID.
+        qCDebug(log_decsyncresource, "moving %d items from %s to %s", items.size(),
+                qUtf8Printable(source), qUtf8Printable(destination));
+        Akonadi::Item::List written;
+        written.reserve(items.size());
+        for (const Akonadi::Item &item : items) {
+            if (!item.remoteId().isEmpty()) {
+                this->writer->setEntry(source, itemPath(item.remoteId()), QJsonValue(), QJsonValue());
+            }
+            written << queueItemWrite(destination, item);
+        }
+        commitWhenWritten([this, written]() {
+            changesCommitted(written);
+        });
+    });
+}
+
+void DecSyncResource::itemsFlagsChanged(const Akonadi::Item::List &items,
+                                        const QSet<QByteArray> &addedFlags,
+                                        const QSet<QByteArray> &removedFlags)
+{
+    Q_UNUSED(items);
+    Q_UNUSED(addedFlags);
+    Q_UNUSED(removedFlags);
+
+    // Contacts and events have no flags in DecSync.
+    changeProcessed();
+}
+
+/*
+ * Collection changes are written to DecSync before they're committed, so a
+ * change Akonadi considers done can't get lost. Changes that can't be written
+ * yet, because the offline mirror is served or writing failed, are kept in
+ * the writer's spool and written once the DecSync folder is available again.
+ * Changes arriving before the folder turned out usable at all are deferred
+ * while the resource is offline until it checks again.
+ */
+
+/**
+ * Writes the changes queued with the writer, and calls commit once they are
+ * in DecSync or kept in the writer's spool.
+ */
+void DecSyncResource::commitWhenWritten(const std::function<void()> &commit)
+{
+    this->writer->flush([commit](bool written) {
+        Q_UNUSED(written);
+        commit();
+    });
 }
 
 void DecSyncResource::collectionAdded(const Akonadi::Collection &collection,
                                       const Akonadi::Collection &parent)
 {
-    Q_UNUSED(collection);
-    Q_UNUSED(parent);
+    if (!this->initialized) {
+        whenInitialized([this, collection, parent](bool ready) {
+            if (ready) {
+                collectionAdded(collection, parent);
+            } else {
+                deferTask();
+            }
+        });
+        return;
+    }
+
+    const QString type = parent.remoteId().section(QPATHSEP, 0, 0);
+    if (appropriateMimetypes(qUtf8Printable(type)).isEmpty()) {
+        cancelTask(i18n("Cannot create a collection here"));
+        return;
+    }
+
+    // Other DecSync clients name new collections randomly, too.
+    const QString remoteId = type + QPATHSEP + QUuid::createUuid().toString(QUuid::WithoutBraces);
+    qCDebug(log_decsyncresource, "creating collection %s", qUtf8Printable(remoteId));
+    this->writer->setStaticInfo(remoteId, QStringLiteral("name"), collection.displayName());
+    const auto color = collection.attribute<Akonadi::CollectionColorAttribute>();
+    if (color && color->color().isValid()) {
+        this->writer->setStaticInfo(remoteId, QStringLiteral("color"), color->color().name());
+    }
+
+    Checkpoint checkpoint;
+    checkpoint.name = collection.displayName();
+    this->checkpoints->put(remoteId, checkpoint);
+
+    Akonadi::Collection created(collection);
+    created.setRemoteId(remoteId);
+    created.setContentMimeTypes(appropriateMimetypes(qUtf8Printable(type)));
+    created.setRights(COLLECTION_RIGHTS);
+    commitWhenWritten([this, created]() {
+        changeCommitted(created);
+    });
 }
 
 void DecSyncResource::collectionChanged(const Akonadi::Collection &collection,
                                         const QSet<QByteArray> &changedAttributes)
 {
-    Q_UNUSED(collection);
-    Q_UNUSED(changedAttributes);
+    if (!this->initialized) {
+        whenInitialized([this, collection, changedAttributes](bool ready) {
+            if (ready) {
+                collectionChanged(collection, changedAttributes);
+            } else {
+                deferTask();
+            }
+        });
+        return;
+    }
+
+    const QString remoteId = collection.remoteId();
+    // Without details on what changed, write everything we know about.
+    const bool all = changedAttributes.isEmpty();
+    if (all || changedAttributes.contains("NAME") || changedAttributes.contains("ENTITYDISPLAY")) {
+        this->writer->setStaticInfo(remoteId, QStringLiteral("name"), collection.displayName());
+        Checkpoint checkpoint = this->checkpoints->get(remoteId);
+        checkpoint.name = collection.displayName();
+        this->checkpoints->put(remoteId, checkpoint);
+    }
+    if (all || changedAttributes.contains(Akonadi::CollectionColorAttribute().type())) {
+        const auto color = collection.attribute<Akonadi::CollectionColorAttribute>();
+        this->writer->setStaticInfo(remoteId, QStringLiteral("color"),
+                                    color && color->color().isValid() ?
+                                        QJsonValue(color->color().name()) : QJsonValue());
+    }
+    commitWhenWritten([this, collection]() {
+        changeCommitted(collection);
+    });
 }
 
 void DecSyncResource::collectionRemoved(const Akonadi::Collection &collection)
 {
-    Q_UNUSED(collection);
+    if (!this->initialized) {
+        whenInitialized([this, collection](bool ready) {
+            if (ready) {
+                collectionRemoved(collection);
+            } else {
+                deferTask();
+            }
+        });
+        return;
+    }
+
+    // DecSync never deletes a collection's directory; other clients just
+    // stop showing it.
+    this->writer->setStaticInfo(collection.remoteId(), QStringLiteral("deleted"), true);
+    this->checkpoints->remove(collection.remoteId());
+    this->stats->remove(collection.remoteId());
+    this->mirror->remove(collection.remoteId());
+    commitWhenWritten([this]() {
+        changeProcessed();
+    });
 }
 
 AKONADI_RESOURCE_MAIN(DecSyncResource)
@@ -18,30 +18,73 @@
 #ifndef DECSYNCRESOURCE_H
 #define DECSYNCRESOURCE_H
 
+#include "replay.h"
+
 #include <ResourceBase>
 
+#include <QElapsedTimer>
+
+#include <functional>
+
 #define MAX_COLLECTIONS      256
 #define FRIENDLY_NAME_LENGTH 256
 #define APPID_LENGTH         256
-#define PATHSEP              '/'
-#define QPATHSEP             QChar::fromLatin1(PATHSEP)
+// Number of items built per step when handing them over to Akonadi. Steps
+// are run until a slice's time budget is used up. Once a collection's
+// average item size is known, steps are sized to hold about
+// BYTES_PER_SLICE_STEP of payloads instead, within the given bounds.
+#define ITEMS_PER_SLICE_STEP     64
+#define MIN_ITEMS_PER_SLICE_STEP 8
+#define MAX_ITEMS_PER_SLICE_STEP 512
+#define BYTES_PER_SLICE_STEP     (256 * 1024)
+// Collections that had at most this many items as of their last sync are
+// always synced in full, which is cheap for them and repairs any drift.
+#define SMALL_COLLECTION_ENTRIES 64
+// Initial syncs of collections with more items than this are committed in
+// several transactions rather than a single one, unless configured otherwise.
+#define LARGE_COLLECTION_ENTRIES 5000
 
 const QList<const char*> COLLECTION_TYPES { "calendars", "contacts" };
 
 /**
- * An instance of this struct is passed to the function called by libdecsync
- * when it reads an item. This lets our function create an item in the correct
- * Akonadi::Item::List and with the correct MIME type.
+ * What libdecsync found out about the DecSync directory when the resource
+ * was initialized.
+ */
+struct DecSyncStatus {
+    // Result of decsync_check_decsync_info(); 0 if the directory is usable.
+    int versionStatus;
+    QByteArray appId;
+    // Whether the offline mirror has any collections to serve.
+    bool hasMirror;
+    // StartupProfile::now() when the directory was checked and when the app
+    // ID was looked up; the latter is 0 if it was cached.
+    qint64 checkedAt;
+    qint64 appIdAt;
+};
+
+/**
+ * A DecSync collection found while listing collections.
  */
-struct ItemListAndMime {
-    Akonadi::Item::List &items;
-    const QString mime;
-    ItemListAndMime(Akonadi::Item::List &list, const QString mimetype)
-        : items{list}, mime{mimetype} {}
+struct ListedCollection {
+    QByteArray type;
+    QByteArray name;
+    // Null if the collection couldn't be opened.
+    QString friendlyName;
+    // Empty if the collection has no colour.
+    QString color;
+    bool deleted;
 };
 
+class CheckpointStore;
+class DecSyncWriter;
+class MirrorStore;
+class QTimer;
+class SliceScheduler;
+class StatsStore;
+class Verifier;
+
 class DecSyncResource : public Akonadi::ResourceBase,
-                        public Akonadi::AgentBase::ObserverV2
+                        public Akonadi::AgentBase::ObserverV3
 {
     Q_OBJECT
 
@@ -62,6 +105,7 @@ protected:
     using Akonadi::ResourceBase::retrieveItems;
 
     void aboutToQuit() override;
+    void abortActivity() override;
 
     void itemAdded(const Akonadi::Item &item,
                    const Akonadi::Collection &collection) override;
@@ -69,6 +113,16 @@ protected:
                      const QSet<QByteArray> &parts) override;
     void itemRemoved(const Akonadi::Item &item) override;
 
+    // Bulk changes, such as deleting or moving many items at once, arrive
+    // as one notification each and are written to DecSync together.
+    void itemsRemoved(const Akonadi::Item::List &items) override;
+    void itemsMoved(const Akonadi::Item::List &items,
+                    const Akonadi::Collection &sourceCollection,
+                    const Akonadi::Collection &destinationCollection) override;
+    void itemsFlagsChanged(const Akonadi::Item::List &items,
+                           const QSet<QByteArray> &addedFlags,
+                           const QSet<QByteArray> &removedFlags) override;
+
     void collectionAdded(const Akonadi::Collection &collection,
                          const Akonadi::Collection &parent) override;
     void collectionRemoved(const Akonadi::Collection &collection) override;
@@ -79,8 +133,86 @@ protected:
     void collectionChanged(const Akonadi::Collection &collection,
                            const QSet<QByteArray> &changedAttributes) override;
 
+private Q_SLOTS:
+    void checkReconnected();
+    void confirmCheckpoint(const QVariant &collectionRemoteId);
+
 private:
-    char appId[APPID_LENGTH];
+    QString dataDirectory() const;
+    void whenInitialized(const std::function<void(bool ready)> &callback);
+    void finishInitialization(const DecSyncStatus &checked);
+    void enterMirrorMode();
+    void leaveMirrorMode();
+    void listCollectionsToSync();
+    void deliverCollections(const QVector<ListedCollection> &listed);
+    void deliverEntries(const Akonadi::Collection &collection,
+                        const QVector<DecodedEntry> &entries,
+                        const QByteArray &signature);
+    void configureItemSync(int items, int step, bool initialSync);
+    void endRetrieval();
+    void commitWhenWritten(const std::function<void()> &commit);
+    void withRemoteIds(const Akonadi::Collection::List &collections,
+                       const std::function<void(const QHash<Akonadi::Collection::Id, QString> &remoteIds)> &callback);
+    void withCollectionRemoteIds(const Akonadi::Item::List &items,
+                                 const std::function<void(const QHash<Akonadi::Collection::Id, QString> &remoteIds)> &callback);
+    Akonadi::Item queueItemWrite(const QString &collectionRemoteId, const Akonadi::Item &item);
+
+    // Empty until the first sync request initialized the resource, unless
+    // it was cached in the settings.
+    QByteArray appId;
+
+    // Whether the DecSync directory was found usable, or the offline mirror
+    // is served instead. Until then, requests wait in pendingInitialization.
+    bool initialized = false;
+    QVector<std::function<void(bool ready)>> pendingInitialization;
+
+    // Builds and hands over items in slices, so the event loop stays
+    // responsive during large syncs.
+    SliceScheduler* sliceScheduler;
+
+    // Whether Akonadi is running a full sync, whose item retrievals are done
+    // in the background.
+    bool inFullSync = false;
+
+    // Context object of the running retrieveItems task, if any. Its
+    // continuations are dropped if it's deleted.
+    QObject* retrieval = nullptr;
+    // Started along with the running retrieveItems task.
+    QElapsedTimer retrievalTimer;
+    // Payload bytes its replay decoded, counted for allocation accounting
+    // until the retrieval ends.
+    qint64 retrievalDecodedBytes = 0;
+    // Started when the first items of a retrieval are handed to Akonadi, and
+    // invalidated once it reports having processed them all.
+    QElapsedTimer itemSyncTimer;
+    QString itemSyncCollection;
+    int itemSyncItems = 0;
+
+    // Signatures and item hashes of every collection as of its last replay.
+    CheckpointStore* checkpoints;
+    // Checkpoint of the last retrieval, until Akonadi committed its items,
+    // and whether that failed.
+    QString unconfirmedCollection;
+    QByteArray unconfirmedSignature;
+    QHash<QString, QByteArray> unconfirmedItemHashes;
+    bool itemSyncFailed = false;
+
+    // Sizes and change rates of collections, to plan syncs with.
+    StatsStore* stats;
+
+    // Copy of every collection's items, served while the DecSync directory
+    // is unavailable. In mirror mode, the resource does just that and checks
+    // periodically whether the directory is back.
+    MirrorStore* mirror;
+    bool mirrorMode = false;
+    QTimer* reconnectTimer;
+    bool checkingReconnected = false;
+
+    // Replays collections in the background to catch drift.
+    Verifier* verifier;
+
+    // Writes changes made in Akonadi back to DecSync, in batches.
+    DecSyncWriter* writer;
 };
 
 #endif
@@ -0,0 +1,307 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "decsyncwriter.h"
+#include "allocationaccounting.h"
+#include "durablefile.h"
+#include "metrics.h"
+#include "replay.h"
+#include "task.h"
+
+#include "../build/src/debug.h"
+
+#include <QDataStream>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QTimer>
+#include <QVector>
+#include <QtConcurrent>
+
+#include <memory>
+
+#include <libdecsync.h>
+
+#define SPOOL_MAGIC   QByteArrayLiteral("DSSP")
+#define SPOOL_VERSION 1
+
+QByteArray encodeJsonValue(const QJsonValue &value)
+{
+    // QJsonDocument can only encode arrays and objects.
+    const QByteArray array = QJsonDocument(QJsonArray { value }).toJson(QJsonDocument::Compact);
+    return array.mid(1, array.size() - 2);
+}
+
+int writeDecSyncBatch(const QString &decsyncDir, const QString &collectionRemoteId,
+                      const QByteArray &appId, const DecSyncBatch &batch)
+{
+    const QByteArray type = collectionRemoteId.section(QPATHSEP, 0, 0).toUtf8();
+    const QByteArray name = collectionRemoteId.section(QPATHSEP, 1).toUtf8();
+
+    Decsync sync;
+    if (int error = decsync_new(&sync, qUtf8Printable(decsyncDir), type.constData(),
+                                name.constData(), appId.constData())) {
+        qCWarning(log_decsyncresource, "failed to open %s for writing: error %d",
+                  qUtf8Printable(collectionRemoteId), error);
+        return error;
+    }
+
+    int written = 0;
+    for (auto path = batch.constBegin(); path != batch.constEnd(); ++path) {
+        QVector<const char*> components;
+        for (const QByteArray &component : path.key()) {
+            components << component.constData();
+        }
+        QVector<DecsyncEntry> entries;
+        for (auto entry = path->constBegin(); entry != path->constEnd(); ++entry) {
+            entries << decsync_entry_new(entry.key().constData(), entry->constData());
+        }
+        decsync_set_entries_for_path(sync, components.data(), components.size(),
+                                     entries.data(), entries.size());
+        for (DecsyncEntry entry : entries) {
+            decsync_entry_free(entry);
+        }
+        written += entries.size();
+    }
+    decsync_free(sync);
+
+    qCDebug(log_decsyncresource, "wrote %d entries to %s",
+            written, qUtf8Printable(collectionRemoteId));
+    Metrics::self()->add(QStringLiteral("writeBatches"), 1);
+    Metrics::self()->add(QStringLiteral("writeEntries"), written);
+    return 0;
+}
+
+/**
+ * Stops accounting for the given batch's entries, once they're written or
+ * dropped.
+ */
+static void releaseBatch(const DecSyncBatch &batch)
+{
+#ifdef DECSYNC_ALLOCATION_ACCOUNTING
+    for (const auto &entries : batch) {
+        for (auto entry = entries.constBegin(); entry != entries.constEnd(); ++entry) {
+            ACCOUNT_RELEASE(WriteQueue, entry.key().size() + entry->size());
+        }
+    }
+#else
+    Q_UNUSED(batch);
+#endif
+}
+
+DecSyncWriter::DecSyncWriter(const QString &spoolPath, QObject* parent)
+    : QObject(parent)
+    , spoolPath{spoolPath}
+{
+    this->writer.setMaxThreadCount(1);
+    this->retryTimer = new QTimer(this);
+    this->retryTimer->setSingleShot(true);
+    this->retryTimer->setInterval(WRITE_RETRY_DELAY_MS);
+    connect(this->retryTimer, &QTimer::timeout, this, [this]() {
+        flush();
+    });
+
+    QByteArray body;
+    if (!readDurableFile(spoolPath, SPOOL_MAGIC, SPOOL_VERSION, &body)) {
+        return;
+    }
+    QDataStream stream(body);
+    stream.setVersion(QDataStream::Qt_5_6);
+    stream >> this->decsyncDir >> this->pending;
+    if (stream.status() != QDataStream::Ok) {
+        qCWarning(log_decsyncresource, "ignoring damaged spool %s", qUtf8Printable(spoolPath));
+        this->decsyncDir.clear();
+        this->pending.clear();
+    }
+    // Written again, or removed, by the next flush.
+    this->spooled = true;
+#ifdef DECSYNC_ALLOCATION_ACCOUNTING
+    for (const DecSyncBatch &batch : this->pending) {
+        for (const auto &entries : batch) {
+            for (auto entry = entries.constBegin(); entry != entries.constEnd(); ++entry) {
+                ACCOUNT_ALLOCATION(WriteQueue, entry.key().size() + entry->size());
+            }
+        }
+    }
+#endif
+    qCDebug(log_decsyncresource, "%d collections have changes left to write",
+            this->pending.size());
+}
+
+DecSyncWriter::~DecSyncWriter()
+{
+    // Don't lose changes made just before quitting.
+    flush();
+    this->writer.waitForDone();
+}
+
+void DecSyncWriter::setTarget(const QString &decsyncDir, const QByteArray &appId)
+{
+    if (decsyncDir != this->decsyncDir && !this->pending.isEmpty()) {
+        qCWarning(log_decsyncresource, "dropping changes not written to %s",
+                  qUtf8Printable(this->decsyncDir));
+        for (const DecSyncBatch &batch : this->pending) {
+            releaseBatch(batch);
+        }
+        this->pending.clear();
+        saveSpool();
+    }
+    this->decsyncDir = decsyncDir;
+    this->appId = appId;
+}
+
+void DecSyncWriter::setHeld(bool held)
+{
+    this->held = held;
+    if (held) {
+        this->retryTimer->stop();
+    } else {
+        flush();
+    }
+}
+
+bool DecSyncWriter::hasPending(const QString &collectionRemoteId) const
+{
+    return this->pending.contains(collectionRemoteId);
+}
+
+void DecSyncWriter::setEntry(const QString &collectionRemoteId, const QByteArrayList &path,
+                             const QJsonValue &key, const QJsonValue &value)
+{
+    QMap<QByteArray, QByteArray> &entries = this->pending[collectionRemoteId][path];
+    const QByteArray encodedKey = encodeJsonValue(key);
+    const QByteArray encodedValue = encodeJsonValue(value);
+    const auto replaced = entries.constFind(encodedKey);
+    if (replaced != entries.constEnd()) {
+        ACCOUNT_RELEASE(WriteQueue, encodedKey.size() + replaced->size());
+    }
+    ACCOUNT_ALLOCATION(WriteQueue, encodedKey.size() + encodedValue.size());
+    entries.insert(encodedKey, encodedValue);
+}
+
+void DecSyncWriter::setStaticInfo(const QString &collectionRemoteId, const QString &key,
+                                  const QJsonValue &value)
+{
+    setEntry(collectionRemoteId, { QByteArrayLiteral("info") }, key, value);
+}
+
+void DecSyncWriter::flush(const std::function<void(bool written)> &done)
+{
+    if (this->held) {
+        if (!this->pending.isEmpty()) {
+            saveSpool();
+        }
+        if (done) {
+            runTask(&this->writer, []() {}).then(this, [done]() {
+                done(false);
+            });
+        }
+        return;
+    }
+
+    this->retryTimer->stop();
+    const QString decsyncDir = this->decsyncDir;
+    const QByteArray appId = this->appId;
+    auto failed = std::make_shared<bool>(false);
+
+    for (auto it = this->pending.constBegin(); it != this->pending.constEnd(); ++it) {
+        const QString collectionRemoteId = it.key();
+        const DecSyncBatch batch = it.value();
+        // Edits and interactive fetches wait for this, so it runs at normal
+        // priority.
+        runTask(&this->writer, [=]() {
+            return writeDecSyncBatch(decsyncDir, collectionRemoteId, appId, batch);
+        }).then(this, [this, decsyncDir, collectionRemoteId, batch, failed](int error) {
+            if (error) {
+                *failed = true;
+            }
+            if (error && decsyncDir == this->decsyncDir) {
+                requeue(collectionRemoteId, batch);
+            } else {
+                releaseBatch(batch);
+            }
+            Q_EMIT flushed(collectionRemoteId, error);
+        });
+    }
+    this->pending.clear();
+
+    // The single writer thread gets to this after all batches above, and
+    // their continuations run in the same order.
+    runTask(&this->writer, []() {}).then(this, [this, failed, done]() {
+        if (*failed || this->spooled) {
+            // Keep what failed, and forget what was written since.
+            saveSpool();
+        }
+        if (*failed && !this->held) {
+            this->retryTimer->start();
+        }
+        if (done) {
+            // Once the spool is saved, too.
+            runTask(&this->writer, []() {}).then(this, [failed, done]() {
+                done(!*failed);
+            });
+        }
+    });
+}
+
+/**
+ * Puts back the entries of a batch that couldn't be written, unless they
+ * were set again since.
+ */
+void DecSyncWriter::requeue(const QString &collectionRemoteId, const DecSyncBatch &batch)
+{
+    DecSyncBatch &pending = this->pending[collectionRemoteId];
+    for (auto path = batch.constBegin(); path != batch.constEnd(); ++path) {
+        QMap<QByteArray, QByteArray> &entries = pending[path.key()];
+        for (auto entry = path->constBegin(); entry != path->constEnd(); ++entry) {
+            if (entries.contains(entry.key())) {
+                ACCOUNT_RELEASE(WriteQueue, entry.key().size() + entry->size());
+            } else {
+                entries.insert(entry.key(), entry.value());
+            }
+        }
+    }
+}
+
+/**
+ * Replaces the spool with the entries pending now, or removes it if there
+ * are none. The file is written on the writer thread, after the batches
+ * flushed so far.
+ */
+void DecSyncWriter::saveSpool()
+{
+    const QString path = this->spoolPath;
+    const QString decsyncDir = this->decsyncDir;
+    const QHash<QString, DecSyncBatch> entries = this->pending;
+    this->spooled = !entries.isEmpty();
+    QtConcurrent::run(&this->writer, [path, decsyncDir, entries]() {
+        if (entries.isEmpty()) {
+            QFile::remove(path);
+            return;
+        }
+        QByteArray body;
+        {
+            QDataStream stream(&body, QIODevice::WriteOnly);
+            stream.setVersion(QDataStream::Qt_5_6);
+            stream << decsyncDir << entries;
+        }
+        if (!writeDurableFile(path, SPOOL_MAGIC, SPOOL_VERSION, body)) {
+            qCWarning(log_decsyncresource, "failed to save changes left to write to %s",
+                      qUtf8Printable(path));
+        }
+    });
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef DECSYNCWRITER_H
+#define DECSYNCWRITER_H
+
+#include <QByteArrayList>
+#include <QHash>
+#include <QJsonValue>
+#include <QMap>
+#include <QObject>
+#include <QThreadPool>
+
+#include <functional>
+
+class QTimer;
+
+// How long to wait before trying again to write entries that couldn't be
+// written.
+#define WRITE_RETRY_DELAY_MS (60 * 1000)
+
+// Values to write by key, by path. Keys and values are JSON-encoded, as
+// libdecsync wants them.
+typedef QMap<QByteArrayList, QMap<QByteArray, QByteArray>> DecSyncBatch;
+
+/**
+ * Encodes a single JSON value, as libdecsync wants keys and values.
+ */
+QByteArray encodeJsonValue(const QJsonValue &value);
+
+/**
+ * Writes all entries of a batch to the given collection, with one
+ * decsync_new() and one call per path. Returns the error libdecsync reported
+ * when opening the collection, if any.
+ *
+ * This blocks on I/O, so call it on a worker thread.
+ */
+int writeDecSyncBatch(const QString &decsyncDir, const QString &collectionRemoteId,
+                      const QByteArray &appId, const DecSyncBatch &batch);
+
+/**
+ * Collects entries to be written to DecSync collections and writes them in
+ * batches with writeDecSyncBatch(), on a worker thread, once flush() is
+ * called. Setting the same key again before the batch is written only keeps
+ * the latest value, so a change touching many items or several keys of a
+ * collection ends up in one write per collection.
+ *
+ * Entries that can't be written yet, because writing them failed or the
+ * writer is held, are kept in a spool file, which is read back on startup,
+ * and written by a later flush. Failed writes are retried after
+ * WRITE_RETRY_DELAY_MS.
+ */
+class DecSyncWriter : public QObject
+{
+    Q_OBJECT
+
+public:
+    /**
+     * Creates a writer that keeps the entries it can't write yet in the file
+     * at spoolPath, and reads back those left there.
+     */
+    explicit DecSyncWriter(const QString &spoolPath, QObject* parent = nullptr);
+    ~DecSyncWriter() override;
+
+    /**
+     * Sets the DecSync directory and app ID that later batches are written
+     * with. Entries still waiting to be written to another directory are
+     * dropped.
+     */
+    void setTarget(const QString &decsyncDir, const QByteArray &appId);
+
+    /**
+     * While held, flushing keeps pending entries in the spool rather than
+     * writing them, e.g. while the DecSync directory is unavailable.
+     * Releasing the writer flushes them.
+     */
+    void setHeld(bool held);
+
+    /**
+     * Whether entries of the given collection are waiting to be written.
+     */
+    bool hasPending(const QString &collectionRemoteId) const;
+
+    void setEntry(const QString &collectionRemoteId, const QByteArrayList &path,
+                  const QJsonValue &key, const QJsonValue &value);
+    void setStaticInfo(const QString &collectionRemoteId, const QString &key,
+                       const QJsonValue &value);
+
+    /**
+     * Starts writing all pending entries now. If given, done is called once
+     * they and everything flushed before are written or kept in the spool,
+     * with whether all of them were written.
+     */
+    void flush(const std::function<void(bool written)> &done = std::function<void(bool)>());
+
+Q_SIGNALS:
+    /**
+     * Emitted once a collection's batch was written, with the error libdecsync
+     * reported when opening the collection, if any.
+     */
+    void flushed(const QString &collectionRemoteId, int error);
+
+private:
+    void requeue(const QString &collectionRemoteId, const DecSyncBatch &batch);
+    void saveSpool();
+
+    // Pending entries by collection remote ID.
+    QHash<QString, DecSyncBatch> pending;
+
+    QString decsyncDir;
+    QByteArray appId;
+    const QString spoolPath;
+    // Whether the spool file may hold entries.
+    bool spooled = false;
+    bool held = false;
+    QTimer* retryTimer;
+    // One thread keeps the writes in order.
+    QThreadPool writer;
+};
+
+#endif
@@ -0,0 +1,131 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "durablefile.h"
+
+#include "../build/src/debug.h"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QFile>
+#include <QFileInfo>
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// Magic, version, body length and SHA-1 of the body.
+#define DURABLE_HEADER_LENGTH (4 + 4 + 4 + 20)
+
+static bool writeAll(int fd, const QByteArray &data)
+{
+    const char* position = data.constData();
+    qint64 remaining = data.size();
+    while (remaining > 0) {
+        const ssize_t written = write(fd, position, remaining);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        position += written;
+        remaining -= written;
+    }
+    return true;
+}
+
+bool writeDurableFile(const QString &path, const QByteArray &magic, quint32 version,
+                      const QByteArray &body)
+{
+    QByteArray header;
+    {
+        QDataStream stream(&header, QIODevice::WriteOnly);
+        stream.writeRawData(magic.constData(), 4);
+        stream << version << static_cast<quint32>(body.size());
+        const QByteArray checksum = QCryptographicHash::hash(body, QCryptographicHash::Sha1);
+        stream.writeRawData(checksum.constData(), checksum.size());
+    }
+
+    const QByteArray target = QFile::encodeName(path);
+    const QByteArray temporary = target + ".tmp";
+    const int fd = open(temporary.constData(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        qCWarning(log_decsyncresource, "failed to create %s: %s",
+                  temporary.constData(), strerror(errno));
+        return false;
+    }
+    const bool ok = writeAll(fd, header) && writeAll(fd, body) && fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(temporary.constData(), target.constData()) != 0) {
+        qCWarning(log_decsyncresource, "failed to write %s: %s",
+                  target.constData(), strerror(errno));
+        unlink(temporary.constData());
+        return false;
+    }
+
+    // Make the rename itself durable, too.
+    const QByteArray directory = QFile::encodeName(QFileInfo(path).absolutePath());
+    const int dirFd = open(directory.constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd >= 0) {
+        fsync(dirFd);
+        close(dirFd);
+    }
+    return true;
+}
+
+bool readDurableFile(const QString &path, const QByteArray &magic, quint32 version,
+                     QByteArray* body)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+    const QByteArray data = file.readAll();
+    if (data.size() < DURABLE_HEADER_LENGTH || !data.startsWith(magic)) {
+        qCWarning(log_decsyncresource, "ignoring %s: not a valid file", qUtf8Printable(path));
+        return false;
+    }
+
+    QDataStream stream(data.mid(4, 8));
+    quint32 fileVersion;
+    quint32 length;
+    stream >> fileVersion >> length;
+    if (fileVersion != version) {
+        qCDebug(log_decsyncresource, "ignoring %s: version %u, expected %u",
+                qUtf8Printable(path), fileVersion, version);
+        return false;
+    }
+
+    *body = data.mid(DURABLE_HEADER_LENGTH);
+    if (static_cast<quint32>(body->size()) != length ||
+        QCryptographicHash::hash(*body, QCryptographicHash::Sha1) != data.mid(12, 20)) {
+        qCWarning(log_decsyncresource, "ignoring %s: checksum mismatch", qUtf8Printable(path));
+        body->clear();
+        return false;
+    }
+    return true;
+}
+
+QString durableFileName(const QString &key, const char* suffix)
+{
+    QByteArray name = key.toUtf8().toPercentEncoding();
+    name += suffix;
+    return QString::fromLatin1(name);
+}
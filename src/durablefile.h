@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef DURABLEFILE_H
+#define DURABLEFILE_H
+
+#include <QByteArray>
+#include <QString>
+
+/**
+ * Writes the given body to a file so that, even if the process or machine
+ * crashes halfway, the file afterwards holds either its previous content or
+ * the new one completely. The body is written to a temporary file, which is
+ * synced to disk and then renamed over the old one.
+ *
+ * The body is preceded by a header holding the given four-byte magic, a
+ * format version, the body's length and its SHA-1, which readDurableFile()
+ * checks. Returns false if the file couldn't be written.
+ */
+bool writeDurableFile(const QString &path, const QByteArray &magic, quint32 version,
+                      const QByteArray &body);
+
+/**
+ * Reads the body of a file written by writeDurableFile(). Returns false if
+ * the file doesn't exist, has a different magic or version, or is damaged.
+ */
+bool readDurableFile(const QString &path, const QByteArray &magic, quint32 version,
+                     QByteArray* body);
+
+/**
+ * Turns a key such as a collection remote ID, which may contain slashes,
+ * into a readable file name with the given suffix.
+ */
+QString durableFileName(const QString &key, const char* suffix);
+
+#endif
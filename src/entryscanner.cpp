@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "entryscanner.h"
+
+#include "../build/src/debug.h"
+
+#include <QCryptographicHash>
+#include <QDirIterator>
+#include <QFile>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+
+// Number of statx requests in flight at once.
+#define URING_QUEUE_DEPTH 256
+#endif
+
+QVector<EntryFileInfo> listEntryFiles(const QString &root)
+{
+    QVector<EntryFileInfo> files;
+    // DecSync keeps its bookkeeping in dot files, which the replay reads too.
+    QDirIterator it(root, QDir::Files | QDir::Hidden | QDir::NoDotAndDotDot,
+                    QDirIterator::Subdirectories);
+    while (it.hasNext()) {
+        EntryFileInfo info;
+        info.path = QFile::encodeName(it.next());
+        files << info;
+    }
+    return files;
+}
+
+#ifdef HAVE_LIBURING
+/**
+ * Runs the statx calls for all files through one io_uring. Returns false if
+ * the ring can't be used, e.g. because the kernel is too old to know
+ * IORING_OP_STATX; some files may have been filled in by then, but the
+ * caller examines them all again anyway.
+ */
+static bool statEntryFilesUring(QVector<EntryFileInfo> &files)
+{
+    struct io_uring ring;
+    if (io_uring_queue_init(URING_QUEUE_DEPTH, &ring, 0) < 0) {
+        return false;
+    }
+
+    // The kernel writes into these asynchronously, so they mustn't move.
+    QVector<struct statx> results(files.size());
+    // Requests set up, handed to the kernel, and finished.
+    int prepared = 0;
+    int submitted = 0;
+    int completed = 0;
+    bool ok = true;
+
+    while (ok && completed < files.size()) {
+        while (prepared < files.size() && prepared - completed < URING_QUEUE_DEPTH) {
+            struct io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+            if (!sqe) {
+                break;
+            }
+            io_uring_prep_statx(sqe, AT_FDCWD, files[prepared].path.constData(),
+                                AT_STATX_SYNC_AS_STAT, STATX_SIZE | STATX_MTIME,
+                                &results[prepared]);
+            io_uring_sqe_set_data(sqe, reinterpret_cast<void*>(static_cast<intptr_t>(prepared)));
+            ++prepared;
+        }
+
+        const int accepted = io_uring_submit_and_wait(&ring, 1);
+        if (accepted < 0) {
+            ok = false;
+            break;
+        }
+        submitted += accepted;
+
+        struct io_uring_cqe* cqe;
+        unsigned head;
+        unsigned seen = 0;
+        io_uring_for_each_cqe(&ring, head, cqe) {
+            const int i = static_cast<int>(reinterpret_cast<intptr_t>(io_uring_cqe_get_data(cqe)));
+            if (cqe->res == -EINVAL) {
+                // Unsupported opcode; let the caller start over without io_uring.
+                ok = false;
+            } else if (cqe->res < 0) {
+                files[i].size = -1;
+            } else {
+                files[i].size = static_cast<qint64>(results[i].stx_size);
+                files[i].mtimeNsec = results[i].stx_mtime.tv_sec * Q_INT64_C(1000000000) +
+                    results[i].stx_mtime.tv_nsec;
+            }
+            ++seen;
+        }
+        io_uring_cq_advance(&ring, seen);
+        completed += seen;
+    }
+
+    // When giving up early, requests the kernel already has may still write
+    // into results, so wait for them before results and the ring go away.
+    while (completed < submitted) {
+        struct io_uring_cqe* cqe;
+        const int error = io_uring_wait_cqe(&ring, &cqe);
+        if (error == -EINTR) {
+            continue;
+        }
+        if (error < 0) {
+            qCWarning(log_decsyncresource, "failed to wait for statx requests: %s", strerror(-error));
+            break;
+        }
+        io_uring_cqe_seen(&ring, cqe);
+        ++completed;
+    }
+
+    io_uring_queue_exit(&ring);
+    return ok;
+}
+#endif
+
+void statEntryFiles(QVector<EntryFileInfo> &files)
+{
+#ifdef HAVE_LIBURING
+    static std::atomic<bool> uringUsable(true);
+    if (uringUsable) {
+        if (statEntryFilesUring(files)) {
+            return;
+        }
+        qCDebug(log_decsyncresource, "io_uring statx unavailable, falling back to stat()");
+        uringUsable = false;
+    }
+#endif
+
+    for (EntryFileInfo &file : files) {
+        struct stat st;
+        if (stat(file.path.constData(), &st) != 0) {
+            file.size = -1;
+            continue;
+        }
+        file.size = st.st_size;
+        file.mtimeNsec = st.st_mtim.tv_sec * Q_INT64_C(1000000000) + st.st_mtim.tv_nsec;
+    }
+}
+
+QByteArray treeSignature(const QString &root)
+{
+    QVector<EntryFileInfo> files = listEntryFiles(root);
+    statEntryFiles(files);
+    // Directory order isn't stable across file systems or runs.
+    std::sort(files.begin(), files.end(),
+              [](const EntryFileInfo &a, const EntryFileInfo &b) { return a.path < b.path; });
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    for (const EntryFileInfo &file : files) {
+        hash.addData(file.path);
+        hash.addData(reinterpret_cast<const char*>(&file.size), sizeof(file.size));
+        hash.addData(reinterpret_cast<const char*>(&file.mtimeNsec), sizeof(file.mtimeNsec));
+    }
+    return hash.result();
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef ENTRYSCANNER_H
+#define ENTRYSCANNER_H
+
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+
+/**
+ * A file below a DecSync collection directory, together with the metadata
+ * change detection needs. size is -1 if the file couldn't be examined.
+ */
+struct EntryFileInfo {
+    QByteArray path;
+    qint64 size = -1;
+    qint64 mtimeNsec = 0;
+};
+
+/**
+ * Lists all files below the given directory without examining them.
+ */
+QVector<EntryFileInfo> listEntryFiles(const QString &root);
+
+/**
+ * Fills in the size and modification time of every given file. On Linux with
+ * io_uring support the statx calls are submitted in large batches; otherwise,
+ * or if the kernel rejects them, each file is stat()ed in turn.
+ */
+void statEntryFiles(QVector<EntryFileInfo> &files);
+
+/**
+ * Lists and examines all files below the given directory and condenses their
+ * names, sizes and modification times into a hash. The hash changes whenever
+ * an entry file is added, removed or rewritten, so it can be compared to a
+ * previous one to find out whether a collection needs replaying at all.
+ */
+QByteArray treeSignature(const QString &root);
+
+#endif
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "iotuner.h"
+#include "metrics.h"
+
+#include "../build/src/debug.h"
+
+// Weight of a new sample in the moving average.
+#define IO_LATENCY_SMOOTHING 0.2
+
+IoTuner* IoTuner::self()
+{
+    static IoTuner instance;
+    return &instance;
+}
+
+IoTuner::IoTuner()
+{
+    // Start out assuming a local disk until we know better.
+    apply(1);
+}
+
+int IoTuner::concurrency() const
+{
+    QMutexLocker locker(&this->mutex);
+    return this->level;
+}
+
+int IoTuner::prefetchDepth() const
+{
+    return this->prefetch.maxThreadCount();
+}
+
+void IoTuner::record(qint64 nsecs)
+{
+    QMutexLocker locker(&this->mutex);
+    const double usecs = nsecs / 1000.0;
+    this->averageUsecs = this->averageUsecs == 0 ? usecs :
+        IO_LATENCY_SMOOTHING * usecs + (1 - IO_LATENCY_SMOOTHING) * this->averageUsecs;
+
+    const int newLevel =
+        this->averageUsecs >= IO_LATENCY_LEVEL_8 ? 8 :
+        this->averageUsecs >= IO_LATENCY_LEVEL_4 ? 4 :
+        this->averageUsecs >= IO_LATENCY_LEVEL_2 ? 2 : 1;
+    Metrics::self()->set(QStringLiteral("ioLatencyUsecs"), qRound64(this->averageUsecs));
+    if (newLevel != this->level) {
+        qCDebug(log_decsyncresource, "average libdecsync latency %.0f us, using %d workers",
+                this->averageUsecs, newLevel);
+        apply(newLevel);
+    }
+}
+
+void IoTuner::apply(int newLevel)
+{
+    this->level = newLevel;
+    // On slow folders, keep the kernel busy with the next collections while
+    // the current ones are worked on.
+    const int depth = newLevel == 1 ? 1 : 2 * newLevel;
+    this->collections.setMaxThreadCount(newLevel);
+    this->prefetch.setMaxThreadCount(depth);
+    Metrics::self()->set(QStringLiteral("ioConcurrency"), newLevel);
+    Metrics::self()->set(QStringLiteral("prefetchDepth"), depth);
+}
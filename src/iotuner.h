@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef IOTUNER_H
+#define IOTUNER_H
+
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QThreadPool>
+
+// Latencies (in microseconds) above which a DecSync folder is considered
+// slow enough to profit from 2, 4 or 8 concurrent workers. Below the first
+// one, as on local SSDs, more threads only contend for the same disk.
+#define IO_LATENCY_LEVEL_2   1000
+#define IO_LATENCY_LEVEL_4   5000
+#define IO_LATENCY_LEVEL_8  20000
+
+/**
+ * Picks how many collections are worked on concurrently, and how many
+ * collections are prefetched at once, based on how long libdecsync calls take.
+ *
+ * Wrap each libdecsync call in an IoTuner::Measurement. The tuner keeps a
+ * moving average of their latency and resizes its thread pools whenever the
+ * average crosses one of the IO_LATENCY_LEVEL_* thresholds. The chosen levels
+ * are published in Metrics.
+ */
+class IoTuner
+{
+public:
+    static IoTuner* self();
+
+    /**
+     * Thread pool for working on collections, e.g. initializing or replaying
+     * them. Its size follows concurrency().
+     *
+     * Work on both pools is done in the background, so it should start by
+     * calling enterBackgroundPriority().
+     */
+    QThreadPool* collectionPool() { return &this->collections; }
+
+    /**
+     * Thread pool for prefetching collection directories. Its size follows
+     * prefetchDepth().
+     */
+    QThreadPool* prefetchPool() { return &this->prefetch; }
+
+    int concurrency() const;
+    int prefetchDepth() const;
+
+    /**
+     * Records how long one libdecsync call took.
+     */
+    void record(qint64 nsecs);
+
+    /**
+     * Times the libdecsync calls made during its lifetime as one sample.
+     * Pass calls > 1 if it covers a loop over many entries, so the average
+     * per call is recorded instead.
+     */
+    class Measurement
+    {
+    public:
+        Measurement() { timer.start(); }
+        ~Measurement() { IoTuner::self()->record(timer.nsecsElapsed() / qMax(1, calls)); }
+        void setCalls(int count) { calls = count; }
+
+    private:
+        QElapsedTimer timer;
+        int calls = 1;
+    };
+
+private:
+    IoTuner();
+    void apply(int level);
+
+    mutable QMutex mutex;
+    double averageUsecs = 0;
+    int level = 0;
+    QThreadPool collections;
+    QThreadPool prefetch;
+};
+
+#endif
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "metrics.h"
+
+Metrics* Metrics::self()
+{
+    static Metrics instance;
+    return &instance;
+}
+
+void Metrics::set(const QString &name, const QVariant &value)
+{
+    QMutexLocker locker(&this->mutex);
+    this->metrics.insert(name, value);
+}
+
+void Metrics::add(const QString &name, qint64 delta)
+{
+    QMutexLocker locker(&this->mutex);
+    this->metrics.insert(name, this->metrics.value(name).toLongLong() + delta);
+}
+
+QVariantMap Metrics::values() const
+{
+    QMutexLocker locker(&this->mutex);
+    return this->metrics;
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <QMutex>
+#include <QObject>
+#include <QVariantMap>
+
+/**
+ * Collects named values describing what the resource is doing, e.g. the I/O
+ * concurrency it settled on, and exports them on D-Bus under /Metrics so they
+ * can be inspected with qdbus while the resource runs. All methods may be
+ * called from any thread.
+ */
+class Metrics : public QObject
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "org.kde.Akonadi.DecSync.Metrics")
+
+public:
+    static Metrics* self();
+
+    void set(const QString &name, const QVariant &value);
+    void add(const QString &name, qint64 delta);
+
+public Q_SLOTS:
+    /**
+     * Returns all values recorded so far.
+     */
+    Q_SCRIPTABLE QVariantMap values() const;
+
+private:
+    mutable QMutex mutex;
+    QVariantMap metrics;
+};
+
+#endif
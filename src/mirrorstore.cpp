@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "mirrorstore.h"
+#include "durablefile.h"
+#include "metrics.h"
+#include "payloadcodec.h"
+#include "payloadstore.h"
+#include "threadpriority.h"
+
+#include "../build/src/debug.h"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QElapsedTimer>
+#include <QDir>
+#include <QFile>
+#include <QtConcurrent>
+
+#define MIRROR_MAGIC      QByteArrayLiteral("DSMR")
+#define MIRROR_SUFFIX     ".mirror"
+#define DICTIONARY_MAGIC  QByteArrayLiteral("DSDC")
+#define DICTIONARY_SUFFIX ".dictionary"
+
+static QDataStream &operator<<(QDataStream &stream, const DecodedEntry &entry)
+{
+    return stream << entry.remoteId << entry.payload << entry.hash;
+}
+
+static QDataStream &operator>>(QDataStream &stream, DecodedEntry &entry)
+{
+    return stream >> entry.remoteId >> entry.payload >> entry.hash;
+}
+
+MirrorStore::MirrorStore(const QString &directory)
+    : directory{directory}
+{
+    QDir().mkpath(directory);
+    this->writer.setMaxThreadCount(1);
+}
+
+MirrorStore::~MirrorStore()
+{
+    this->writer.waitForDone();
+}
+
+QString MirrorStore::pathFor(const QString &collectionRemoteId) const
+{
+    return this->directory + QLatin1Char('/') +
+        durableFileName(collectionRemoteId, MIRROR_SUFFIX);
+}
+
+/**
+ * Identifies a dictionary, so that payloads compressed with another one
+ * aren't fed to the wrong decompressor.
+ */
+static QByteArray dictionaryId(const QByteArray &dictionary)
+{
+    return QCryptographicHash::hash(dictionary, QCryptographicHash::Sha1).left(8);
+}
+
+QByteArray MirrorStore::dictionary(const QString &collectionType) const
+{
+    QMutexLocker locker(&this->dictionariesMutex);
+    const auto cached = this->dictionaries.constFind(collectionType);
+    if (cached != this->dictionaries.constEnd()) {
+        return *cached;
+    }
+
+    QByteArray dictionary;
+    readDurableFile(this->directory + QLatin1Char('/') +
+                    durableFileName(collectionType, DICTIONARY_SUFFIX),
+                    DICTIONARY_MAGIC, MIRROR_VERSION, &dictionary);
+    this->dictionaries.insert(collectionType, dictionary);
+    return dictionary;
+}
+
+/**
+ * Trains and stores the dictionary of the given collection type, unless it
+ * already has one. Called on the writer thread only.
+ */
+QByteArray MirrorStore::trainDictionary(const QString &collectionType,
+                                        const QVector<DecodedEntry> &entries)
+{
+    QByteArray existing = dictionary(collectionType);
+    if (!existing.isEmpty()) {
+        return existing;
+    }
+
+    QVector<QByteArray> samples;
+    samples.reserve(entries.size());
+    for (const DecodedEntry &entry : entries) {
+        samples << entry.payload;
+    }
+    const QByteArray trained = trainPayloadDictionary(samples);
+    if (trained.isEmpty()) {
+        return trained;
+    }
+
+    qCDebug(log_decsyncresource, "trained %d byte dictionary for %s",
+            trained.size(), qUtf8Printable(collectionType));
+    writeDurableFile(this->directory + QLatin1Char('/') +
+                     durableFileName(collectionType, DICTIONARY_SUFFIX),
+                     DICTIONARY_MAGIC, MIRROR_VERSION, trained);
+    QMutexLocker locker(&this->dictionariesMutex);
+    this->dictionaries.insert(collectionType, trained);
+    return trained;
+}
+
+QStringList MirrorStore::collections() const
+{
+    QStringList remoteIds;
+    const QStringList files = QDir(this->directory).entryList(
+        { QStringLiteral("*" MIRROR_SUFFIX) }, QDir::Files);
+    for (QString file : files) {
+        file.chop(qstrlen(MIRROR_SUFFIX));
+        remoteIds << QString::fromUtf8(QByteArray::fromPercentEncoding(file.toLatin1()));
+    }
+    return remoteIds;
+}
+
+QVector<DecodedEntry> MirrorStore::load(const QString &collectionRemoteId) const
+{
+    QVector<DecodedEntry> entries;
+    QByteArray body;
+    if (!readDurableFile(pathFor(collectionRemoteId), MIRROR_MAGIC, MIRROR_VERSION, &body)) {
+        return entries;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    QDataStream stream(body);
+    stream.setVersion(QDataStream::Qt_5_6);
+    QByteArray usedDictionaryId;
+    stream >> usedDictionaryId >> entries;
+
+    // Collections saved before their type had a dictionary don't use one.
+    const QByteArray dictionary = usedDictionaryId.isEmpty() ? QByteArray() :
+        this->dictionary(collectionRemoteId.section(QPATHSEP, 0, 0));
+    bool ok = stream.status() == QDataStream::Ok &&
+        (usedDictionaryId.isEmpty() || usedDictionaryId == dictionaryId(dictionary));
+    PayloadDecompressor decompressor(dictionary);
+    for (int i = 0; ok && i < entries.size(); ++i) {
+        const QByteArray payload = decompressor.decompress(entries[i].payload);
+        ok = !payload.isNull();
+        if (ok) {
+            entries[i].payload = PayloadStore::self()->intern(payload, contentHash(payload));
+        }
+    }
+
+    if (!ok) {
+        qCWarning(log_decsyncresource, "ignoring damaged mirror of %s",
+                  qUtf8Printable(collectionRemoteId));
+        entries.clear();
+    }
+    Metrics::self()->add(QStringLiteral("mirrorDecodeUsecs"), timer.nsecsElapsed() / 1000);
+    return entries;
+}
+
+void MirrorStore::save(const QString &collectionRemoteId, const QVector<DecodedEntry> &entries)
+{
+    const QString path = pathFor(collectionRemoteId);
+    const QString collectionType = collectionRemoteId.section(QPATHSEP, 0, 0);
+    QtConcurrent::run(&this->writer, [this, path, collectionType, entries]() {
+        enterBackgroundPriority();
+
+        const QByteArray dictionary = trainDictionary(collectionType, entries);
+        PayloadCompressor compressor(dictionary);
+        QVector<DecodedEntry> compressed = entries;
+        qint64 rawBytes = 0;
+        qint64 compressedBytes = 0;
+        for (DecodedEntry &entry : compressed) {
+            rawBytes += entry.payload.size();
+            entry.payload = compressor.compress(entry.payload);
+            compressedBytes += entry.payload.size();
+        }
+        Metrics::self()->add(QStringLiteral("mirrorPayloadBytes"), rawBytes);
+        Metrics::self()->add(QStringLiteral("mirrorCompressedBytes"), compressedBytes);
+
+        QByteArray body;
+        {
+            QDataStream stream(&body, QIODevice::WriteOnly);
+            stream.setVersion(QDataStream::Qt_5_6);
+            stream << (dictionary.isEmpty() ? QByteArray() : dictionaryId(dictionary))
+                   << compressed;
+        }
+        writeDurableFile(path, MIRROR_MAGIC, MIRROR_VERSION, body);
+    });
+}
+
+void MirrorStore::remove(const QString &collectionRemoteId)
+{
+    const QString path = pathFor(collectionRemoteId);
+    // Gone from collections() right away, and again after any save that's
+    // still queued.
+    QFile::remove(path);
+    QtConcurrent::run(&this->writer, [path]() {
+        QFile::remove(path);
+    });
+}
+
+void MirrorStore::clear()
+{
+    {
+        QMutexLocker locker(&this->dictionariesMutex);
+        this->dictionaries.clear();
+    }
+    const QString directory = this->directory;
+    QtConcurrent::run(&this->writer, [directory]() {
+        QDir dir(directory);
+        const QStringList files = dir.entryList(
+            { QStringLiteral("*" MIRROR_SUFFIX), QStringLiteral("*" DICTIONARY_SUFFIX) },
+            QDir::Files);
+        for (const QString &file : files) {
+            dir.remove(file);
+        }
+    });
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef MIRRORSTORE_H
+#define MIRRORSTORE_H
+
+#include "replay.h"
+
+#include <QHash>
+#include <QMutex>
+#include <QStringList>
+#include <QThreadPool>
+
+// Bump this whenever the serialized form of mirrored entries, the way their
+// hashes are computed or the form of item remote IDs changes.
+#define MIRROR_VERSION 4
+
+/**
+ * Keeps a copy of every collection's items as of its last replay in the
+ * resource's data directory, one file per collection, so that items can
+ * still be served while the DecSync directory is unavailable, e.g. on an
+ * unmounted volume.
+ *
+ * Payloads are compressed one by one with a PayloadCompressor, using a
+ * dictionary per collection type that is trained on the first collection of
+ * that type big enough to train on. They are decompressed when loaded.
+ *
+ * Files are written with writeDurableFile() on a background thread.
+ */
+class MirrorStore
+{
+public:
+    explicit MirrorStore(const QString &directory);
+    ~MirrorStore();
+
+    /**
+     * Returns the remote IDs of all collections that have a mirror.
+     */
+    QStringList collections() const;
+
+    /**
+     * Reads the mirrored entries of the given collection. This blocks on
+     * I/O, so call it on a worker thread.
+     */
+    QVector<DecodedEntry> load(const QString &collectionRemoteId) const;
+
+    void save(const QString &collectionRemoteId, const QVector<DecodedEntry> &entries);
+    void remove(const QString &collectionRemoteId);
+    void clear();
+
+private:
+    QString pathFor(const QString &collectionRemoteId) const;
+    QByteArray dictionary(const QString &collectionType) const;
+    QByteArray trainDictionary(const QString &collectionType,
+                               const QVector<DecodedEntry> &entries);
+
+    const QString directory;
+    QThreadPool writer;
+
+    // Dictionaries by collection type, loaded lazily.
+    mutable QMutex dictionariesMutex;
+    mutable QHash<QString, QByteArray> dictionaries;
+};
+
+#endif
@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "payloadcodec.h"
+
+#include "../build/src/debug.h"
+
+#ifdef HAVE_ZSTD
+#include <zdict.h>
+#include <zstd.h>
+
+// Favour speed; the dictionary does most of the work on small payloads.
+#define ZSTD_LEVEL 3
+#endif
+
+#define CODEC_NONE 'n'
+#define CODEC_ZLIB 'q'
+#define CODEC_ZSTD 'z'
+
+PayloadCompressor::PayloadCompressor(const QByteArray &dictionary)
+{
+#ifdef HAVE_ZSTD
+    this->context = ZSTD_createCCtx();
+    if (!dictionary.isEmpty()) {
+        this->dictionary = ZSTD_createCDict(dictionary.constData(), dictionary.size(), ZSTD_LEVEL);
+    }
+#else
+    Q_UNUSED(dictionary);
+#endif
+}
+
+PayloadCompressor::~PayloadCompressor()
+{
+#ifdef HAVE_ZSTD
+    ZSTD_freeCDict(this->dictionary);
+    ZSTD_freeCCtx(this->context);
+#endif
+}
+
+QByteArray PayloadCompressor::compress(const QByteArray &payload)
+{
+#ifdef HAVE_ZSTD
+    if (this->context) {
+        QByteArray compressed(1 + ZSTD_compressBound(payload.size()), Qt::Uninitialized);
+        compressed[0] = CODEC_ZSTD;
+        const size_t size = this->dictionary ?
+            ZSTD_compress_usingCDict(this->context, compressed.data() + 1, compressed.size() - 1,
+                                     payload.constData(), payload.size(), this->dictionary) :
+            ZSTD_compressCCtx(this->context, compressed.data() + 1, compressed.size() - 1,
+                              payload.constData(), payload.size(), ZSTD_LEVEL);
+        if (!ZSTD_isError(size)) {
+            compressed.resize(1 + size);
+            return compressed;
+        }
+    }
+#endif
+
+    const QByteArray zlib = qCompress(payload, 1);
+    if (zlib.size() < payload.size()) {
+        return QByteArray(1, CODEC_ZLIB) + zlib;
+    }
+    return QByteArray(1, CODEC_NONE) + payload;
+}
+
+PayloadDecompressor::PayloadDecompressor(const QByteArray &dictionary)
+{
+#ifdef HAVE_ZSTD
+    this->context = ZSTD_createDCtx();
+    if (!dictionary.isEmpty()) {
+        this->dictionary = ZSTD_createDDict(dictionary.constData(), dictionary.size());
+    }
+#else
+    Q_UNUSED(dictionary);
+#endif
+}
+
+PayloadDecompressor::~PayloadDecompressor()
+{
+#ifdef HAVE_ZSTD
+    ZSTD_freeDDict(this->dictionary);
+    ZSTD_freeDCtx(this->context);
+#endif
+}
+
+QByteArray PayloadDecompressor::decompress(const QByteArray &compressed)
+{
+    if (compressed.isEmpty()) {
+        return QByteArray();
+    }
+    const char* data = compressed.constData() + 1;
+    const int size = compressed.size() - 1;
+
+    switch (compressed[0]) {
+    case CODEC_NONE:
+        return compressed.mid(1);
+    case CODEC_ZLIB:
+        return qUncompress(reinterpret_cast<const uchar*>(data), size);
+#ifdef HAVE_ZSTD
+    case CODEC_ZSTD: {
+        const unsigned long long length = ZSTD_getFrameContentSize(data, size);
+        if (!this->context || length == ZSTD_CONTENTSIZE_ERROR ||
+            length == ZSTD_CONTENTSIZE_UNKNOWN) {
+            return QByteArray();
+        }
+        QByteArray payload(static_cast<int>(length), Qt::Uninitialized);
+        const size_t result = this->dictionary ?
+            ZSTD_decompress_usingDDict(this->context, payload.data(), payload.size(),
+                                       data, size, this->dictionary) :
+            ZSTD_decompressDCtx(this->context, payload.data(), payload.size(), data, size);
+        return ZSTD_isError(result) ? QByteArray() : payload;
+    }
+#endif
+    default:
+        return QByteArray();
+    }
+}
+
+QByteArray trainPayloadDictionary(const QVector<QByteArray> &samples)
+{
+#ifdef HAVE_ZSTD
+    if (samples.size() < PAYLOAD_DICTIONARY_MIN_SAMPLES) {
+        return QByteArray();
+    }
+
+    QByteArray buffer;
+    QVector<size_t> sizes;
+    sizes.reserve(samples.size());
+    for (const QByteArray &sample : samples) {
+        buffer += sample;
+        sizes << static_cast<size_t>(sample.size());
+    }
+
+    QByteArray dictionary(PAYLOAD_DICTIONARY_SIZE, Qt::Uninitialized);
+    const size_t size = ZDICT_trainFromBuffer(dictionary.data(), dictionary.size(),
+                                              buffer.constData(), sizes.constData(),
+                                              static_cast<unsigned>(sizes.size()));
+    if (ZDICT_isError(size)) {
+        qCDebug(log_decsyncresource, "failed to train payload dictionary: %s",
+                ZDICT_getErrorName(size));
+        return QByteArray();
+    }
+    dictionary.resize(static_cast<int>(size));
+    return dictionary;
+#else
+    Q_UNUSED(samples);
+    return QByteArray();
+#endif
+}
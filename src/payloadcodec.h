@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PAYLOADCODEC_H
+#define PAYLOADCODEC_H
+
+#include <QByteArray>
+#include <QVector>
+
+struct ZSTD_CCtx_s;
+struct ZSTD_CDict_s;
+struct ZSTD_DCtx_s;
+struct ZSTD_DDict_s;
+
+// Size of the dictionaries trained for each collection type. vCards and
+// iCalendar objects share most of their property names and structure, so a
+// small dictionary already captures them.
+#define PAYLOAD_DICTIONARY_SIZE (16 * 1024)
+
+// Don't train a dictionary on fewer payloads than this.
+#define PAYLOAD_DICTIONARY_MIN_SAMPLES 64
+
+/**
+ * Compresses payloads one by one, so that each one can be decompressed on
+ * its own. With zstd, a dictionary trained on payloads of the same
+ * collection type makes up for the little context a single vCard offers;
+ * without zstd, payloads are compressed with qCompress() and the dictionary
+ * is ignored.
+ *
+ * The first byte of each compressed payload names the codec used, so that
+ * PayloadDecompressor can reject payloads it can't handle.
+ */
+class PayloadCompressor
+{
+public:
+    explicit PayloadCompressor(const QByteArray &dictionary = QByteArray());
+    ~PayloadCompressor();
+
+    QByteArray compress(const QByteArray &payload);
+
+private:
+    Q_DISABLE_COPY(PayloadCompressor)
+
+    ZSTD_CCtx_s* context = nullptr;
+    ZSTD_CDict_s* dictionary = nullptr;
+};
+
+class PayloadDecompressor
+{
+public:
+    explicit PayloadDecompressor(const QByteArray &dictionary = QByteArray());
+    ~PayloadDecompressor();
+
+    /**
+     * Returns the original payload, or a null QByteArray if the payload is
+     * damaged or was compressed with a codec this build doesn't support.
+     */
+    QByteArray decompress(const QByteArray &compressed);
+
+private:
+    Q_DISABLE_COPY(PayloadDecompressor)
+
+    ZSTD_DCtx_s* context = nullptr;
+    ZSTD_DDict_s* dictionary = nullptr;
+};
+
+/**
+ * Trains a compression dictionary on the given payloads. Returns an empty
+ * dictionary if there are too few of them or zstd isn't available.
+ */
+QByteArray trainPayloadDictionary(const QVector<QByteArray> &samples);
+
+#endif
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "payloadstore.h"
+#include "allocationaccounting.h"
+#include "metrics.h"
+
+PayloadStore* PayloadStore::self()
+{
+    static PayloadStore instance;
+    return &instance;
+}
+
+QByteArray PayloadStore::intern(const QByteArray &payload, const QByteArray &hash)
+{
+    QMutexLocker locker(&this->mutex);
+    ++this->lookups;
+    const auto existing = this->payloads.constFind(hash);
+    if (existing != this->payloads.constEnd()) {
+        ++this->hits;
+        this->bytesShared += existing->size();
+        updateMetrics();
+        return *existing;
+    }
+    this->payloads.insert(hash, payload);
+    ACCOUNT_ALLOCATION(Caches, payload.size());
+    updateMetrics();
+    return payload;
+}
+
+void PayloadStore::prune()
+{
+    QMutexLocker locker(&this->mutex);
+    for (auto it = this->payloads.begin(); it != this->payloads.end();) {
+        // isDetached() means our copy is the only reference left.
+        if (it->isDetached()) {
+            ACCOUNT_RELEASE(Caches, it->size());
+            it = this->payloads.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    Metrics::self()->set(QStringLiteral("payloadsStored"), this->payloads.size());
+}
+
+void PayloadStore::updateMetrics()
+{
+    Metrics* metrics = Metrics::self();
+    metrics->set(QStringLiteral("payloadsStored"), this->payloads.size());
+    metrics->set(QStringLiteral("payloadBytesShared"), this->bytesShared);
+    // Payloads seen per payload actually kept in memory.
+    metrics->set(QStringLiteral("payloadDedupRatio"),
+                 static_cast<double>(this->lookups) / qMax<qint64>(1, this->lookups - this->hits));
+}
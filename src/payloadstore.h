@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PAYLOADSTORE_H
+#define PAYLOADSTORE_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QMutex>
+
+/**
+ * Content-addressed store of item payloads, so that the same contact or
+ * event in several collections is kept in memory only once.
+ *
+ * intern() returns the payload already stored under the same content hash,
+ * if any, which then shares its data with all other copies thanks to
+ * QByteArray's implicit sharing. Payloads nobody else refers to anymore are
+ * dropped by prune(). All methods may be called from any thread.
+ */
+class PayloadStore
+{
+public:
+    static PayloadStore* self();
+
+    QByteArray intern(const QByteArray &payload, const QByteArray &hash);
+
+    /**
+     * Drops payloads that are only referred to by the store itself.
+     */
+    void prune();
+
+private:
+    PayloadStore() = default;
+    void updateMetrics();
+
+    QMutex mutex;
+    QHash<QByteArray, QByteArray> payloads;
+    qint64 lookups = 0;
+    qint64 hits = 0;
+    qint64 bytesShared = 0;
+};
+
+#endif
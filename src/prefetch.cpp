@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "prefetch.h"
+#include "entryscanner.h"
+#include "iotuner.h"
+#include "threadpriority.h"
+
+#include "../build/src/debug.h"
+
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QSet>
+#include <QtConcurrent>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+    QMutex inFlightMutex;
+    QSet<QString> inFlight;
+}
+
+int prefetchDirectory(const QString &collectionDir)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    int hinted = 0;
+    for (const EntryFileInfo &file : listEntryFiles(collectionDir)) {
+        const int fd = open(file.path.constData(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+#ifdef POSIX_FADV_WILLNEED
+        // This only queues asynchronous read-ahead; it doesn't block on I/O.
+        if (0 == posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED)) {
+            ++hinted;
+        }
+#endif
+        close(fd);
+    }
+
+    qCDebug(log_decsyncresource, "prefetched %d files in %s in %lld ms",
+            hinted, qUtf8Printable(collectionDir), timer.elapsed());
+    return hinted;
+}
+
+void schedulePrefetch(const QString &collectionDir)
+{
+    {
+        QMutexLocker locker(&inFlightMutex);
+        if (inFlight.contains(collectionDir)) {
+            return;
+        }
+        inFlight.insert(collectionDir);
+    }
+
+    QtConcurrent::run(IoTuner::self()->prefetchPool(), [collectionDir]() {
+        enterBackgroundPriority();
+        prefetchDirectory(collectionDir);
+        QMutexLocker locker(&inFlightMutex);
+        inFlight.remove(collectionDir);
+    });
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include <QString>
+
+/**
+ * Asks the kernel to read every entry file below the given DecSync collection
+ * directory into the page cache, so that a following replay through
+ * libdecsync doesn't stall on one small synchronous read per entry.
+ *
+ * The directory is enumerated and the hints are issued on a background
+ * thread, so this function returns immediately. Requests for a directory that
+ * is still being prefetched are ignored.
+ */
+void schedulePrefetch(const QString &collectionDir);
+
+/**
+ * Does the work of schedulePrefetch() on the calling thread. Returns the
+ * number of files the kernel accepted a read-ahead hint for.
+ */
+int prefetchDirectory(const QString &collectionDir);
+
+#endif
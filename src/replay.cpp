@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "replay.h"
+#include "canonicalize.h"
+#include "entryscanner.h"
+#include "iotuner.h"
+#include "payloadstore.h"
+#include "threadpriority.h"
+
+#include "../build/src/debug.h"
+
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonValue>
+#include <QStringList>
+
+#include <libdecsync.h>
+
+const QString collectionDirectory(const QString &decsyncDir,
+                                  const char* collectionType, const char* collectionName)
+{
+    return decsyncDir + QPATHSEP +
+        QString::fromUtf8(collectionType) + QPATHSEP +
+        QString::fromUtf8(collectionName);
+}
+
+QByteArray contentHash(const QByteArray &payload)
+{
+    return QCryptographicHash::hash(payload, QCryptographicHash::Sha1);
+}
+
+QByteArray itemHash(const QByteArray &payload)
+{
+    return contentHash(canonicalPayload(payload));
+}
+
+namespace {
+    struct EntryReader {
+        const EntryCallback* callback;
+        int count;
+    };
+}
+
+static void onEntryUpdate(const char** path, const int len, const char* datetime,
+                          const char* key, const char* value, void* extra)
+{
+    // value contains a JSON-encoded string, not the actual value!
+    // Wrap it in [ ] so QJsonDocument can decode it.
+    QByteArray arrayified = QByteArray(value).prepend('[').append(']');
+    QJsonValue payload = QJsonDocument::fromJson(arrayified).array().first();
+    if (payload.isNull()) {
+        // This item is deleted. Do nothing.
+        return;
+    }
+
+    // Only entries below ["resources"] are read, and the rest of the path,
+    // the item's UID, is unique within the collection. Leaving out the
+    // common prefix keeps Akonadi's remote ID column and index small.
+    QStringList pathComponents;
+    for (int i = 1; i < len; ++i) {
+        pathComponents << QString::fromUtf8(path[i]);
+    }
+    QString remoteId = pathComponents.join(QPATHSEP);
+
+    qCDebug(log_decsyncresource, "got update notification: path=%s datetime=%s key=%s",
+            qUtf8Printable(remoteId), datetime, key);
+
+    EntryReader* reader = static_cast<EntryReader*>(extra);
+    (*reader->callback)(remoteId, payload.toString().toUtf8());
+    ++reader->count;
+}
+
+int readEntries(const QString &decsyncDir, const QByteArray &type, const QByteArray &name,
+                const QByteArray &appId, const EntryCallback &callback)
+{
+    Decsync sync;
+    if (int error = decsync_new(&sync, qUtf8Printable(decsyncDir), type.constData(),
+                                name.constData(), appId.constData())) {
+        return error;
+    }
+
+#define PATH_LENGTH 1
+    const char* path[PATH_LENGTH] { "resources" };
+    decsync_add_listener(sync, path, PATH_LENGTH, onEntryUpdate);
+    EntryReader reader { &callback, 0 };
+    {
+        IoTuner::Measurement measurement;
+        decsync_execute_all_stored_entries_for_path_prefix(sync, path, PATH_LENGTH, &reader);
+        measurement.setCalls(reader.count);
+    }
+#undef PATH_LENGTH
+
+    decsync_free(sync);
+    return 0;
+}
+
+int readEntry(const QString &decsyncDir, const QByteArray &type, const QByteArray &name,
+              const QByteArray &appId, const QString &remoteId, const EntryCallback &callback)
+{
+    Decsync sync;
+    if (int error = decsync_new(&sync, qUtf8Printable(decsyncDir), type.constData(),
+                                name.constData(), appId.constData())) {
+        return error;
+    }
+
+    const char* prefix[1] { "resources" };
+    decsync_add_listener(sync, prefix, 1, onEntryUpdate);
+    const QByteArray uid = remoteId.toUtf8();
+    const char* path[2] { "resources", uid.constData() };
+    EntryReader reader { &callback, 0 };
+    {
+        IoTuner::Measurement measurement;
+        // Items are stored under the null key.
+        decsync_execute_stored_entry(sync, path, 2, "null", &reader);
+    }
+
+    decsync_free(sync);
+    return 0;
+}
+
+ReplayResult replayCollection(const QString &decsyncDir, const QString &collDir,
+                              const QByteArray &type, const QByteArray &name,
+                              const QByteArray &appId,
+                              const QByteArray &previousSignature,
+                              bool background)
+{
+    if (background) {
+        enterBackgroundPriority();
+    }
+
+    ReplayResult result;
+    // If no entry file was added, removed or rewritten since the last replay,
+    // Akonadi already has every item and there's nothing to read.
+    result.signature = treeSignature(collDir);
+    if (result.signature == previousSignature) {
+        result.unchanged = true;
+        return result;
+    }
+
+    QElapsedTimer replayTimer;
+    replayTimer.start();
+
+    result.error = readEntries(decsyncDir, type, name, appId,
+                               [&result](const QString &remoteId, const QByteArray &payload) {
+        // The same item may be in several collections; keep it in memory once.
+        const QByteArray interned = PayloadStore::self()->intern(payload, contentHash(payload));
+        if (interned.constData() == payload.constData()) {
+            result.decodedBytes += payload.size();
+        }
+        result.entries.append({ remoteId, interned, itemHash(payload) });
+    });
+    if (result.error) {
+        return result;
+    }
+
+    qCDebug(log_decsyncresource, "replayed %d items of %s/%s in %lld ms",
+            result.entries.size(), type.constData(), name.constData(), replayTimer.elapsed());
+    return result;
+}
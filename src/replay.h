@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+
+#include <functional>
+
+#define PATHSEP              '/'
+#define QPATHSEP             QChar::fromLatin1(PATHSEP)
+
+/**
+ * An entry read by libdecsync, with its value decoded from JSON. Entries are
+ * read and decoded on a worker thread; Akonadi items are only created from
+ * them on the main thread.
+ */
+struct DecodedEntry {
+    // The item's UID.
+    QString remoteId;
+    QByteArray payload;
+    // itemHash() of the payload.
+    QByteArray hash;
+};
+
+/**
+ * What replayCollection() found out about a collection.
+ */
+struct ReplayResult {
+    QByteArray signature;
+    bool unchanged = false;
+    int error = 0;
+    QVector<DecodedEntry> entries;
+    // Bytes of payloads this replay added to the PayloadStore, rather than
+    // sharing ones already there.
+    qint64 decodedBytes = 0;
+};
+
+/**
+ * Gets the directory libdecsync keeps the entries of the given collection in.
+ */
+const QString collectionDirectory(const QString &decsyncDir,
+                                  const char* collectionType, const char* collectionName);
+
+/**
+ * Hashes the exact bytes of a payload.
+ */
+QByteArray contentHash(const QByteArray &payload);
+
+/**
+ * Hashes an item's payload, to tell whether it changed without keeping or
+ * comparing the whole payload. Payloads that only differ in serialization
+ * details, such as line folding or property order, hash the same.
+ */
+QByteArray itemHash(const QByteArray &payload);
+
+/**
+ * Called with the remote ID, i.e. the UID, and decoded payload of each item
+ * read.
+ */
+typedef std::function<void(const QString &remoteId, const QByteArray &payload)> EntryCallback;
+
+/**
+ * Reads all items of the given collection and calls callback for each of
+ * them as soon as it's decoded, without keeping them around. The entries
+ * read are those stored for appId; nothing is written to the DecSync
+ * directory. Returns the error libdecsync reported when opening the
+ * collection, if any.
+ *
+ * This blocks on I/O, so call it on a worker thread.
+ */
+int readEntries(const QString &decsyncDir, const QByteArray &type, const QByteArray &name,
+                const QByteArray &appId, const EntryCallback &callback);
+
+/**
+ * Reads the item with the given remote ID from the entries stored for appId,
+ * calling callback with it unless it doesn't exist or is deleted. Returns the
+ * error libdecsync reported when opening the collection, if any.
+ *
+ * This blocks on I/O, so call it on a worker thread.
+ */
+int readEntry(const QString &decsyncDir, const QByteArray &type, const QByteArray &name,
+              const QByteArray &appId, const QString &remoteId, const EntryCallback &callback);
+
+/**
+ * Reads all items of the given collection, unless the treeSignature() of its
+ * directory still matches previousSignature. Pass an empty previousSignature
+ * to always read them. If background is set, the calling thread enters
+ * background priority first.
+ *
+ * This blocks on I/O, so call it on a worker thread.
+ */
+ReplayResult replayCollection(const QString &decsyncDir, const QString &collDir,
+                              const QByteArray &type, const QByteArray &name,
+                              const QByteArray &appId,
+                              const QByteArray &previousSignature,
+                              bool background);
+
+#endif
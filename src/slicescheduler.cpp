@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "slicescheduler.h"
+
+#include <QElapsedTimer>
+#include <QTimer>
+
+SliceScheduler::SliceScheduler(QObject* parent)
+    : QObject(parent), budgetMsecs{8}, sliceQueued{false}
+{
+}
+
+void SliceScheduler::setBudget(int msecs)
+{
+    this->budgetMsecs = msecs;
+}
+
+void SliceScheduler::schedule(const std::function<bool()> &job)
+{
+    this->jobs.enqueue(QSharedPointer<std::function<bool()>>::create(job));
+    if (!this->sliceQueued) {
+        this->sliceQueued = true;
+        QTimer::singleShot(0, this, &SliceScheduler::runSlice);
+    }
+}
+
+void SliceScheduler::clear()
+{
+    this->jobs.clear();
+}
+
+bool SliceScheduler::isIdle() const
+{
+    return this->jobs.isEmpty();
+}
+
+void SliceScheduler::runSlice()
+{
+    this->sliceQueued = false;
+
+    QElapsedTimer timer;
+    timer.start();
+    while (!this->jobs.isEmpty() && timer.elapsed() < this->budgetMsecs) {
+        const QSharedPointer<std::function<bool()>> job = this->jobs.head();
+        const bool finished = (*job)();
+        if (finished && !this->jobs.isEmpty() && this->jobs.head() == job) {
+            this->jobs.dequeue();
+        }
+    }
+
+    if (!this->jobs.isEmpty() && !this->sliceQueued) {
+        this->sliceQueued = true;
+        QTimer::singleShot(0, this, &SliceScheduler::runSlice);
+    }
+}
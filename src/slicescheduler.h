@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SLICESCHEDULER_H
+#define SLICESCHEDULER_H
+
+#include <QObject>
+#include <QQueue>
+#include <QSharedPointer>
+
+#include <functional>
+
+/**
+ * Runs long-running work on the event loop thread in slices, so that D-Bus
+ * calls and abort requests are still handled while it runs.
+ *
+ * A job is a function that does a small step of work and returns true once
+ * the whole job is finished. The scheduler keeps calling the first queued
+ * job until the time budget of the current slice is used up, then returns to
+ * the event loop and continues with the next slice on its next iteration.
+ */
+class SliceScheduler : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit SliceScheduler(QObject* parent = nullptr);
+
+    /**
+     * Sets how long a slice may run before yielding to the event loop.
+     */
+    void setBudget(int msecs);
+
+    void schedule(const std::function<bool()> &job);
+
+    /**
+     * Drops all queued jobs, including a partially done one.
+     */
+    void clear();
+
+    bool isIdle() const;
+
+private Q_SLOTS:
+    void runSlice();
+
+private:
+    // Jobs keep state between calls, so they're shared rather than copied
+    // while running in case they clear the queue.
+    QQueue<QSharedPointer<std::function<bool()>>> jobs;
+    int budgetMsecs;
+    bool sliceQueued;
+};
+
+#endif
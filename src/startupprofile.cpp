@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "startupprofile.h"
+
+#include "../build/src/debug.h"
+
+#include <QDateTime>
+#include <QFile>
+#include <QSaveFile>
+#include <QTextStream>
+#include <QTimer>
+
+#ifdef Q_OS_LINUX
+#include <unistd.h>
+#endif
+
+/**
+ * Gets how many milliseconds ago the process started, from the kernel's
+ * records. Returns 0 where that isn't known.
+ */
+static qint64 msecsSinceProcessStart()
+{
+#ifdef Q_OS_LINUX
+    QFile statFile(QStringLiteral("/proc/self/stat"));
+    QFile uptimeFile(QStringLiteral("/proc/uptime"));
+    if (!statFile.open(QIODevice::ReadOnly) || !uptimeFile.open(QIODevice::ReadOnly)) {
+        return 0;
+    }
+    // The command name in parentheses may contain spaces; the start time is
+    // the 20th field after it.
+    const QByteArray stat = statFile.readAll();
+    const QList<QByteArray> fields = stat.mid(stat.lastIndexOf(')') + 2).split(' ');
+    const double uptime = uptimeFile.readAll().split(' ').first().toDouble();
+    if (fields.size() < 20) {
+        return 0;
+    }
+    const double startTime = fields[19].toDouble() / sysconf(_SC_CLK_TCK);
+    return qMax<qint64>(0, qint64((uptime - startTime) * 1000));
+#else
+    return 0;
+#endif
+}
+
+StartupProfile* StartupProfile::self()
+{
+    static StartupProfile instance;
+    return &instance;
+}
+
+StartupProfile::StartupProfile()
+{
+    this->timer.start();
+    this->startOffset = msecsSinceProcessStart();
+    this->phases.append({ QStringLiteral("process start"), 0 });
+}
+
+qint64 StartupProfile::now()
+{
+    QElapsedTimer clock;
+    clock.start();
+    return clock.msecsSinceReference();
+}
+
+void StartupProfile::mark(const QString &phase)
+{
+    mark(phase, now());
+}
+
+void StartupProfile::mark(const QString &phase, qint64 when)
+{
+    if (this->reported || this->marked.contains(phase)) {
+        return;
+    }
+    this->marked.insert(phase);
+    const qint64 msecs = this->startOffset + when - this->timer.msecsSinceReference();
+    // Phases timed on other threads may be marked after later ones.
+    auto position = this->phases.end();
+    while (position != this->phases.begin() && (position - 1)->msecs > msecs) {
+        --position;
+    }
+    this->phases.insert(position, { phase, msecs });
+    qCDebug(log_decsyncresource, "startup: %s after %lld ms", qUtf8Printable(phase), msecs);
+}
+
+void StartupProfile::expectCollections(const QStringList &remoteIds)
+{
+    if (this->expecting) {
+        return;
+    }
+    this->expecting = true;
+    for (const QString &remoteId : remoteIds) {
+        if (!this->marked.contains(QStringLiteral("first items of ") + remoteId)) {
+            this->pending.insert(remoteId);
+        }
+    }
+    if (this->pending.isEmpty()) {
+        writeReport();
+        return;
+    }
+    QTimer::singleShot(STARTUP_PROFILE_TIMEOUT, [this]() { writeReport(); });
+}
+
+void StartupProfile::collectionReady(const QString &remoteId)
+{
+    mark(QStringLiteral("first items of ") + remoteId);
+    if (this->pending.remove(remoteId) && this->pending.isEmpty()) {
+        writeReport();
+    }
+}
+
+void StartupProfile::setReportPath(const QString &path)
+{
+    this->reportPath = path;
+}
+
+void StartupProfile::writeReport()
+{
+    if (this->reported) {
+        return;
+    }
+    this->reported = true;
+    if (this->reportPath.isEmpty()) {
+        return;
+    }
+
+    QSaveFile file(this->reportPath);
+    if (!file.open(QIODevice::WriteOnly)) {
+        qCWarning(log_decsyncresource, "cannot write startup profile to %s: %s",
+                  qUtf8Printable(this->reportPath), qUtf8Printable(file.errorString()));
+        return;
+    }
+    QTextStream out(&file);
+    out << "DecSync resource startup profile, "
+        << QDateTime::currentDateTime().toString(Qt::ISODate) << "\n\n";
+    out << qSetFieldWidth(10) << "total ms" << "step ms" << qSetFieldWidth(0) << "  phase\n";
+    qint64 previous = 0;
+    for (const Phase &phase : this->phases) {
+        out << qSetFieldWidth(10) << phase.msecs << phase.msecs - previous
+            << qSetFieldWidth(0) << "  " << phase.name << "\n";
+        previous = phase.msecs;
+    }
+    for (const QString &remoteId : this->pending) {
+        out << qSetFieldWidth(20) << "" << qSetFieldWidth(0)
+            << "  no items of " << remoteId << " within "
+            << STARTUP_PROFILE_TIMEOUT / 1000 << " s\n";
+    }
+    out.flush();
+    if (file.commit()) {
+        qCInfo(log_decsyncresource, "startup profile written to %s",
+               qUtf8Printable(this->reportPath));
+    }
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STARTUPPROFILE_H
+#define STARTUPPROFILE_H
+
+#include <QElapsedTimer>
+#include <QSet>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+// How long after the first collection listing the report is written, even
+// if some collections never had their items retrieved.
+#define STARTUP_PROFILE_TIMEOUT (2 * 60 * 1000)
+
+/**
+ * Records when the phases of the resource's startup were reached, from the
+ * start of the process until every collection had its first items handed to
+ * Akonadi, and writes them to a report, so it's easy to see which phase a
+ * startup regression is in.
+ *
+ * Phases are always recorded, which is cheap; the report is only written
+ * once a report path was set. Only use this on the main thread.
+ */
+class StartupProfile
+{
+public:
+    static StartupProfile* self();
+
+    /**
+     * Records that the given phase was reached, unless it already was.
+     */
+    void mark(const QString &phase);
+
+    /**
+     * Records that the given phase was reached at the given now() time,
+     * for phases that ran on another thread.
+     */
+    void mark(const QString &phase, qint64 when);
+
+    /**
+     * Returns the current time on the clock phases are measured with. Unlike
+     * the other methods, this may be called from any thread.
+     */
+    static qint64 now();
+
+    /**
+     * Sets the collections whose first items are waited for. The report is
+     * written once all of them are ready, or after STARTUP_PROFILE_TIMEOUT.
+     */
+    void expectCollections(const QStringList &remoteIds);
+    void collectionReady(const QString &remoteId);
+
+    /**
+     * Enables the report, which is written to the given file.
+     */
+    void setReportPath(const QString &path);
+
+private:
+    StartupProfile();
+    void writeReport();
+
+    struct Phase {
+        QString name;
+        qint64 msecs;
+    };
+
+    QElapsedTimer timer;
+    // Milliseconds between the process start and the timer's.
+    qint64 startOffset = 0;
+    QVector<Phase> phases;
+    QSet<QString> marked;
+    QSet<QString> pending;
+    bool expecting = false;
+    bool reported = false;
+    QString reportPath;
+};
+
+#endif
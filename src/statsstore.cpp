@@ -0,0 +1,151 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "statsstore.h"
+#include "durablefile.h"
+#include "threadpriority.h"
+
+#include <QDataStream>
+#include <QDateTime>
+#include <QTimer>
+#include <QtConcurrent>
+
+#define STATS_MAGIC        QByteArrayLiteral("DSST")
+#define STATS_SAVE_DELAY   (5 * 1000)
+
+static QDataStream &operator<<(QDataStream &stream, const CollectionStats &stats)
+{
+    return stream << stats.entries << stats.bytes << stats.lastDurationMsecs
+                  << stats.changeRate << stats.lastChanged;
+}
+
+static QDataStream &operator>>(QDataStream &stream, CollectionStats &stats)
+{
+    return stream >> stats.entries >> stats.bytes >> stats.lastDurationMsecs
+                  >> stats.changeRate >> stats.lastChanged;
+}
+
+StatsStore::StatsStore(const QString &path, QObject* parent)
+    : QObject(parent), path{path}
+{
+    this->writer.setMaxThreadCount(1);
+    this->saveTimer = new QTimer(this);
+    this->saveTimer->setSingleShot(true);
+    this->saveTimer->setInterval(STATS_SAVE_DELAY);
+    connect(this->saveTimer, &QTimer::timeout, this, &StatsStore::save);
+
+    QByteArray body;
+    if (readDurableFile(path, STATS_MAGIC, STATS_VERSION, &body)) {
+        QDataStream stream(body);
+        stream.setVersion(QDataStream::Qt_5_6);
+        stream >> this->collections;
+        if (stream.status() != QDataStream::Ok) {
+            this->collections.clear();
+        }
+    }
+}
+
+StatsStore::~StatsStore()
+{
+    if (this->saveTimer->isActive()) {
+        save();
+    }
+    this->writer.waitForDone();
+}
+
+CollectionStats StatsStore::get(const QString &collectionRemoteId) const
+{
+    QMutexLocker locker(&this->mutex);
+    return this->collections.value(collectionRemoteId);
+}
+
+void StatsStore::record(const QString &collectionRemoteId, bool changed, int entries,
+                        qint64 bytes, qint64 durationMsecs)
+{
+    {
+        QMutexLocker locker(&this->mutex);
+        CollectionStats &stats = this->collections[collectionRemoteId];
+        stats.changeRate = (1 - CHANGE_RATE_WEIGHT) * stats.changeRate +
+            CHANGE_RATE_WEIGHT * (changed ? 1 : 0);
+        stats.lastDurationMsecs = durationMsecs;
+        if (changed) {
+            stats.entries = entries;
+            stats.bytes = bytes;
+            stats.lastChanged = QDateTime::currentMSecsSinceEpoch();
+        }
+    }
+    scheduleSave();
+}
+
+void StatsStore::remove(const QString &collectionRemoteId)
+{
+    {
+        QMutexLocker locker(&this->mutex);
+        this->collections.remove(collectionRemoteId);
+    }
+    scheduleSave();
+}
+
+void StatsStore::clear()
+{
+    {
+        QMutexLocker locker(&this->mutex);
+        this->collections.clear();
+    }
+    scheduleSave();
+}
+
+QVariantMap StatsStore::stats() const
+{
+    QMutexLocker locker(&this->mutex);
+    QVariantMap result;
+    for (auto it = this->collections.constBegin(); it != this->collections.constEnd(); ++it) {
+        result.insert(it.key(), QVariantMap {
+            { QStringLiteral("entries"), it->entries },
+            { QStringLiteral("bytes"), it->bytes },
+            { QStringLiteral("lastDurationMsecs"), it->lastDurationMsecs },
+            { QStringLiteral("changeRate"), it->changeRate },
+            { QStringLiteral("lastChanged"), it->lastChanged },
+        });
+    }
+    return result;
+}
+
+void StatsStore::scheduleSave()
+{
+    // Syncing many collections in a row ends up in a single write.
+    if (!this->saveTimer->isActive()) {
+        this->saveTimer->start();
+    }
+}
+
+void StatsStore::save()
+{
+    this->saveTimer->stop();
+    QByteArray body;
+    {
+        QMutexLocker locker(&this->mutex);
+        QDataStream stream(&body, QIODevice::WriteOnly);
+        stream.setVersion(QDataStream::Qt_5_6);
+        stream << this->collections;
+    }
+    const QString path = this->path;
+    QtConcurrent::run(&this->writer, [path, body]() {
+        enterBackgroundPriority();
+        writeDurableFile(path, STATS_MAGIC, STATS_VERSION, body);
+    });
+}
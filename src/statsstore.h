@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STATSSTORE_H
+#define STATSSTORE_H
+
+#include <QHash>
+#include <QMutex>
+#include <QObject>
+#include <QThreadPool>
+#include <QVariantMap>
+
+class QTimer;
+
+// Bump this whenever the serialized form of CollectionStats changes.
+#define STATS_VERSION 1
+
+// Weight of the latest sync in a collection's change rate.
+#define CHANGE_RATE_WEIGHT 0.2
+
+/**
+ * What the resource has learned about a collection from syncing it.
+ */
+struct CollectionStats {
+    int entries = 0;
+    qint64 bytes = 0;
+    // How long the last replay took, until all items were handed over.
+    qint64 lastDurationMsecs = 0;
+    // Moving average of whether syncs found changes, between 0 and 1.
+    double changeRate = 0;
+    // When a sync last found changes, in milliseconds since the epoch.
+    qint64 lastChanged = 0;
+
+    bool isHot() const { return this->changeRate >= 0.5; }
+};
+
+/**
+ * Keeps CollectionStats for every collection in a single file in the
+ * resource's data directory, and exports them on D-Bus under /Stats.
+ *
+ * The resource uses them to decide in which order to open collections and
+ * how many items to build at once. Stats are saved a few seconds after they
+ * last changed, with writeDurableFile() on a background thread. get() may be
+ * called from any thread, the other methods only from the main thread.
+ */
+class StatsStore : public QObject
+{
+    Q_OBJECT
+    Q_CLASSINFO("D-Bus Interface", "org.kde.Akonadi.DecSync.Stats")
+
+public:
+    explicit StatsStore(const QString &path, QObject* parent = nullptr);
+    ~StatsStore() override;
+
+    CollectionStats get(const QString &collectionRemoteId) const;
+
+    /**
+     * Records a sync of the given collection. If it found no changes,
+     * entries and bytes are left as they were.
+     */
+    void record(const QString &collectionRemoteId, bool changed, int entries,
+                qint64 bytes, qint64 durationMsecs);
+
+    void remove(const QString &collectionRemoteId);
+    void clear();
+
+public Q_SLOTS:
+    /**
+     * Returns the stats of all collections, by remote ID.
+     */
+    Q_SCRIPTABLE QVariantMap stats() const;
+
+private:
+    void scheduleSave();
+    void save();
+
+    const QString path;
+    mutable QMutex mutex;
+    QHash<QString, CollectionStats> collections;
+    QTimer* saveTimer;
+    QThreadPool writer;
+};
+
+#endif
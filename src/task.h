@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef TASK_H
+#define TASK_H
+
+#include <QFutureWatcher>
+#include <QObject>
+#include <QThreadPool>
+#include <QtConcurrent>
+
+namespace detail {
+    template<typename T>
+    struct Continuation {
+        template<typename Callback>
+        static void call(const Callback &callback, const QFuture<T> &future)
+        {
+            callback(future.result());
+        }
+    };
+
+    template<>
+    struct Continuation<void> {
+        template<typename Callback>
+        static void call(const Callback &callback, const QFuture<void> &)
+        {
+            callback();
+        }
+    };
+}
+
+/**
+ * Work running on a thread pool, to be continued on the event loop thread.
+ *
+ * Create one with runTask(), then pass a callback to then(), which receives
+ * the result of the work (or nothing if it returns void). The callback is
+ * run in the thread of the given context object, and only if that object
+ * still exists by the time the work is done, so deleting the context object
+ * cancels the continuation:
+ *
+ *     runTask(pool, [=]() { return readSomething(path); })
+ *         .then(this, [this](const Something &result) { useIt(result); });
+ */
+template<typename T>
+class Task
+{
+public:
+    explicit Task(const QFuture<T> &future) : future{future} {}
+
+    template<typename Callback>
+    void then(QObject* context, Callback callback) const
+    {
+        auto* watcher = new QFutureWatcher<T>(context);
+        QObject::connect(watcher, &QFutureWatcherBase::finished, context,
+                         [watcher, callback]() {
+                             watcher->deleteLater();
+                             detail::Continuation<T>::call(callback, watcher->future());
+                         });
+        watcher->setFuture(this->future);
+    }
+
+    QFuture<T> future;
+};
+
+template<typename Work>
+auto runTask(QThreadPool* pool, Work work) -> Task<decltype(work())>
+{
+    return Task<decltype(work())>(QtConcurrent::run(pool, work));
+}
+
+#endif
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "threadpriority.h"
+
+#include "../build/src/debug.h"
+
+#include <atomic>
+
+#ifdef Q_OS_LINUX
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// glibc has no wrapper for ioprio_set, so take these from linux/ioprio.h.
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_IDLE  3
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_PRIO_VALUE(cls, data) (((cls) << IOPRIO_CLASS_SHIFT) | (data))
+#endif
+
+namespace {
+    std::atomic<int> backgroundNiceness(0);
+    std::atomic<bool> backgroundIdleIo(false);
+    thread_local bool inBackgroundPriority = false;
+}
+
+void configureBackgroundPriority(int niceness, bool idleIo)
+{
+    backgroundNiceness = niceness;
+    backgroundIdleIo = idleIo;
+}
+
+void enterBackgroundPriority()
+{
+    if (inBackgroundPriority) {
+        return;
+    }
+    inBackgroundPriority = true;
+
+#ifdef Q_OS_LINUX
+    // On Linux, both of these apply to the calling thread only when given
+    // its thread ID (or 0 for ioprio_set), not to the whole process.
+    const pid_t tid = static_cast<pid_t>(syscall(SYS_gettid));
+    if (const int niceness = backgroundNiceness) {
+        if (setpriority(PRIO_PROCESS, tid, niceness) != 0) {
+            qCDebug(log_decsyncresource, "failed to set niceness %d of thread %d", niceness, tid);
+        }
+    }
+    if (backgroundIdleIo) {
+        if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                    IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)) != 0) {
+            qCDebug(log_decsyncresource, "failed to set idle I/O priority of thread %d", tid);
+        }
+    }
+#endif
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef THREADPRIORITY_H
+#define THREADPRIORITY_H
+
+/**
+ * Sets the nice value and whether to use the idle I/O scheduling class for
+ * threads that enter background priority from now on. A niceness of 0 and
+ * idleIo = false leave background threads at normal priority.
+ */
+void configureBackgroundPriority(int niceness, bool idleIo);
+
+/**
+ * Lowers the CPU and I/O priority of the calling thread as configured, so
+ * that background syncs and maintenance don't compete with the user's
+ * applications. Does nothing if the thread already entered background
+ * priority.
+ *
+ * Only call this on threads that do nothing but background work: without
+ * privileges, a thread's priority can't be raised again.
+ */
+void enterBackgroundPriority();
+
+#endif
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "typedpayload.h"
+#include "metrics.h"
+
+#include <QElapsedTimer>
+#include <QtConcurrent>
+
+#include <KContacts/VCardConverter>
+#include <KCalendarCore/ICalFormat>
+
+static TypedPayload parseContact(const DecodedEntry &entry)
+{
+    TypedPayload typed;
+    KContacts::VCardConverter converter;
+    typed.contact = converter.parseVCard(entry.payload);
+    return typed;
+}
+
+static TypedPayload parseIncidence(const DecodedEntry &entry)
+{
+    TypedPayload typed;
+    // ICalFormat keeps state between calls, so each parse gets its own.
+    KCalendarCore::ICalFormat format;
+    typed.incidence = format.readIncidence(entry.payload);
+    return typed;
+}
+
+QVector<TypedPayload> parsePayloads(const QVector<DecodedEntry> &entries, const QByteArray &type)
+{
+    QElapsedTimer timer;
+    timer.start();
+    // The calling thread takes part in the work, too, so waiting on the pool
+    // it belongs to can't dead-lock.
+    QVector<TypedPayload> typed = type == "contacts" ?
+        QtConcurrent::blockingMapped<QVector<TypedPayload>>(entries, parseContact) :
+        QtConcurrent::blockingMapped<QVector<TypedPayload>>(entries, parseIncidence);
+    Metrics::self()->add(QStringLiteral("parallelParseUsecs"), timer.nsecsElapsed() / 1000);
+    Metrics::self()->add(QStringLiteral("parallelParsedItems"), typed.size());
+    return typed;
+}
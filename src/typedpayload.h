@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef TYPEDPAYLOAD_H
+#define TYPEDPAYLOAD_H
+
+#include "replay.h"
+
+#include <QVector>
+
+#include <KContacts/Addressee>
+#include <KCalendarCore/Incidence>
+
+/**
+ * A payload parsed into the type Akonadi's serializer plugins deal in. At
+ * most one of contact and incidence is set; neither is if parsing failed.
+ */
+struct TypedPayload {
+    KContacts::Addressee contact;
+    KCalendarCore::Incidence::Ptr incidence;
+
+    bool isValid() const { return !this->contact.isEmpty() || this->incidence; }
+    QString uid() const { return this->incidence ? this->incidence->uid() : this->contact.uid(); }
+};
+
+/**
+ * Parses the payloads of the given entries of a collection of the given type
+ * ("contacts" or "calendars") on the global thread pool, spreading them over
+ * all cores. The result at each index belongs to the entry at that index.
+ *
+ * This blocks until all payloads are parsed, so call it on a worker thread.
+ */
+QVector<TypedPayload> parsePayloads(const QVector<DecodedEntry> &entries, const QByteArray &type);
+
+#endif
@@ -0,0 +1,204 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "verifier.h"
+#include "checkpointstore.h"
+#include "iotuner.h"
+#include "payloadstore.h"
+#include "replay.h"
+#include "statsstore.h"
+#include "task.h"
+
+#include "../build/src/settings.h"
+#include "../build/src/debug.h"
+
+#include <CollectionFetchJob>
+#include <CollectionFetchScope>
+#include <ItemFetchJob>
+#include <ItemFetchScope>
+
+#include <algorithm>
+
+Verifier::Verifier(const QString &resourceId, const CheckpointStore* checkpoints,
+                   const StatsStore* stats, QObject* parent)
+    : QObject(parent), resourceId{resourceId}, checkpoints{checkpoints}, stats{stats}
+{
+    connect(&this->timer, &QTimer::timeout, this, &Verifier::start);
+}
+
+void Verifier::setAppId(const QByteArray &appId)
+{
+    this->appId = appId;
+}
+
+void Verifier::setInterval(int minutes)
+{
+    if (minutes > 0) {
+        this->timer.start(minutes * 60 * 1000);
+    } else {
+        this->timer.stop();
+    }
+}
+
+void Verifier::setBudget(qint64 bytes)
+{
+    this->budget = bytes;
+}
+
+void Verifier::start()
+{
+    if (this->running || Settings::self()->decSyncDirectory().isEmpty()) {
+        return;
+    }
+    this->running = true;
+    this->spent = 0;
+
+    auto* job = new Akonadi::CollectionFetchJob(Akonadi::Collection::root(),
+                                                Akonadi::CollectionFetchJob::Recursive, this);
+    job->fetchScope().setResource(this->resourceId);
+    connect(job, &KJob::result, this, &Verifier::collectionsFetched);
+}
+
+void Verifier::collectionsFetched(KJob* job)
+{
+    if (job->error()) {
+        qCWarning(log_decsyncresource, "verification: failed to fetch collections: %s",
+                  qUtf8Printable(job->errorString()));
+        this->running = false;
+        return;
+    }
+
+    this->queue.clear();
+    const QStringList disabled = Settings::self()->disabledCollections();
+    const auto collections = static_cast<Akonadi::CollectionFetchJob*>(job)->collections();
+    for (const Akonadi::Collection &collection : collections) {
+        // Skip the per-type parent collections, which hold no items, and
+        // collections that aren't synced.
+        if (!collection.remoteId().endsWith(QPATHSEP) &&
+            collection.shouldList(Akonadi::Collection::ListSync) &&
+            !disabled.contains(collection.remoteId())) {
+            this->queue << collection;
+        }
+    }
+
+    // Continue with the collection after the one the last pass stopped at.
+    std::sort(this->queue.begin(), this->queue.end(),
+              [](const Akonadi::Collection &a, const Akonadi::Collection &b) {
+                  return a.remoteId() < b.remoteId();
+              });
+    const QString last = this->lastVerified;
+    const auto next = std::find_if(this->queue.begin(), this->queue.end(),
+                                   [&last](const Akonadi::Collection &collection) {
+                                       return collection.remoteId() > last;
+                                   });
+    std::rotate(this->queue.begin(), next, this->queue.end());
+
+    verifyNext();
+}
+
+void Verifier::verifyNext()
+{
+    // Replaying reads a collection in one go, so check its size beforehand.
+    // Those too big for any pass are left out; stopping before the others
+    // lets the next pass start with them.
+    while (!this->queue.isEmpty() && this->stats->get(this->queue.first().remoteId()).bytes > this->budget) {
+        qCDebug(log_decsyncresource, "verification: %s is bigger than the budget, skipping it",
+                qUtf8Printable(this->queue.first().remoteId()));
+        this->lastVerified = this->queue.takeFirst().remoteId();
+    }
+    if (this->queue.isEmpty() ||
+        this->spent + this->stats->get(this->queue.first().remoteId()).bytes > this->budget ||
+        this->spent >= this->budget) {
+        qCDebug(log_decsyncresource, "verification pass done after reading %lld bytes",
+                this->spent);
+        this->running = false;
+        // The replays interned every payload they read; nothing but the
+        // store refers to them anymore.
+        PayloadStore::self()->prune();
+        return;
+    }
+
+    const Akonadi::Collection collection = this->queue.takeFirst();
+    this->lastVerified = collection.remoteId();
+
+    const QList<QByteArray> components = collection.remoteId().toUtf8().split(PATHSEP);
+    const QByteArray type = components[0];
+    const QByteArray name = components[1];
+    const QString decsyncDir = Settings::self()->decSyncDirectory();
+    const QString collDir = collectionDirectory(decsyncDir, type.constData(), name.constData());
+    const QByteArray appId = this->appId;
+
+    runTask(IoTuner::self()->collectionPool(), [=]() {
+        return replayCollection(decsyncDir, collDir, type, name, appId, QByteArray(), true);
+    }).then(this, [this, collection](const ReplayResult &result) {
+        if (result.error) {
+            qCDebug(log_decsyncresource, "verification: failed to open %s: error %d",
+                    qUtf8Printable(collection.remoteId()), result.error);
+            verifyNext();
+            return;
+        }
+
+        QHash<QString, QByteArray> replayed;
+        for (const DecodedEntry &entry : result.entries) {
+            replayed.insert(entry.remoteId, entry.hash);
+            this->spent += entry.payload.size();
+        }
+        compare(collection, replayed);
+    });
+}
+
+void Verifier::compare(const Akonadi::Collection &collection,
+                       const QHash<QString, QByteArray> &replayed)
+{
+    auto* job = new Akonadi::ItemFetchJob(collection, this);
+    // Only look at what Akonadi already has; don't make it ask us.
+    job->fetchScope().setCacheOnly(true);
+    job->fetchScope().fetchFullPayload(false);
+    job->fetchScope().setFetchRemoteIdentification(true);
+
+    connect(job, &KJob::result, this, [this, job, collection, replayed]() {
+        if (job->error()) {
+            qCDebug(log_decsyncresource, "verification: failed to fetch items of %s: %s",
+                    qUtf8Printable(collection.remoteId()), qUtf8Printable(job->errorString()));
+            verifyNext();
+            return;
+        }
+
+        // Collections that were never replayed have no hashes yet.
+        const QHash<QString, QByteArray> indexed =
+            this->checkpoints->get(collection.remoteId()).itemHashes;
+        bool drifted = !indexed.isEmpty() && indexed != replayed;
+
+        const Akonadi::Item::List items = job->items();
+        drifted = drifted || items.size() != replayed.size();
+        for (const Akonadi::Item &item : items) {
+            if (drifted) {
+                break;
+            }
+            const auto hash = replayed.constFind(item.remoteId());
+            drifted = hash == replayed.constEnd() ||
+                QString::fromLatin1(hash->toHex()) != item.remoteRevision();
+        }
+
+        if (drifted) {
+            qCInfo(log_decsyncresource, "verification: %s has drifted, syncing it again",
+                   qUtf8Printable(collection.remoteId()));
+            Q_EMIT driftDetected(collection);
+        }
+        verifyNext();
+    });
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2020 by Timo Wilken <timo.21.wilken@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef VERIFIER_H
+#define VERIFIER_H
+
+#include <Collection>
+
+#include <QHash>
+#include <QObject>
+#include <QTimer>
+
+class CheckpointStore;
+class KJob;
+class StatsStore;
+
+/**
+ * Periodically replays the resource's collections in the background to catch
+ * items that incremental syncs missed.
+ *
+ * Each replayed collection's content hashes are compared to those in its
+ * checkpoint and to the remote revisions Akonadi stored. If they differ, the collection
+ * has drifted and driftDetected() is emitted, so that the resource can sync
+ * it again. A pass reads at most its byte budget: it stops before a
+ * collection whose size as of its last sync would exceed what's left, and the
+ * next pass continues with that collection. Collections bigger than the whole
+ * budget are skipped.
+ */
+class Verifier : public QObject
+{
+    Q_OBJECT
+
+public:
+    Verifier(const QString &resourceId, const CheckpointStore* checkpoints,
+             const StatsStore* stats, QObject* parent = nullptr);
+
+    void setAppId(const QByteArray &appId);
+
+    /**
+     * Sets the minutes between passes; 0 disables verification.
+     */
+    void setInterval(int minutes);
+
+    /**
+     * Sets how many bytes of payloads a pass may read at most.
+     */
+    void setBudget(qint64 bytes);
+
+Q_SIGNALS:
+    void driftDetected(const Akonadi::Collection &collection);
+
+public Q_SLOTS:
+    void start();
+
+private Q_SLOTS:
+    void collectionsFetched(KJob* job);
+
+private:
+    void verifyNext();
+    void compare(const Akonadi::Collection &collection,
+                 const QHash<QString, QByteArray> &replayed);
+
+    const QString resourceId;
+    const CheckpointStore* checkpoints;
+    const StatsStore* stats;
+    QByteArray appId;
+    QTimer timer;
+    qint64 budget = 0;
+
+    bool running = false;
+    Akonadi::Collection::List queue;
+    qint64 spent = 0;
+    // Remote ID of the last collection verified, to continue after it.
+    QString lastVerified;
+};
+
+#endif